@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "jit.h"
+#include "machine.h"
+
+// Benchmark suite for the core, printing JSON so that runs can be compared
+// across commits. Each workload is run twice: once timed on the normal
+// execution path, then once more one instruction at a time to count opcodes
+// and sample their host cost. A single instruction takes less time than the
+// clock takes to read, so runs of them are timed together and the time shared
+// between their opcodes. The runs are deterministic, so the counts line up
+// with the timed run.
+
+#define ALU_CYCLES 200000000
+#define CPUDIAG_RUNS 1000
+#define SAMPLE_MASK 0xff // start timing a batch every 256 instructions
+#define SAMPLE_BATCH 16 // instructions timed together
+
+typedef struct {
+    long long instructions;
+    long long cycles;
+    long long count[0x100];
+    long long op_cycles[0x100];
+    long long samples[0x100];
+    double sampled_ns[0x100];
+} Counts;
+
+typedef struct {
+    char *name;
+    bool skipped;
+    char *reason;
+    double seconds; // of the timed run
+    long long cycles;
+    long frames;
+    Counts counts;
+} Result;
+
+static double clock_overhead;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool file_exists(char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f)
+        fclose(f);
+    return f != NULL;
+}
+
+// Cost of the timing itself, taken off every batch
+static double measure_clock_overhead() {
+    double total = 0;
+    for (int i = 0; i < 100000; i++) {
+        double start = now();
+        total += now() - start;
+    }
+    return total / 100000;
+}
+
+static int counted_op(Cpu_state *state, Counts *counts) {
+    uint8_t op_code = read_memory(state, state->pc);
+    int cyc = emulate_op(state);
+
+    counts->instructions++;
+    counts->count[op_code]++;
+    counts->op_cycles[op_code] += cyc;
+    counts->cycles += cyc;
+    return cyc;
+}
+
+// Times up to SAMPLE_BATCH instructions together, stopping early at the
+// budget, and shares the time evenly between their opcodes. Noise in the
+// clock can make a batch look quicker than the clock alone, which counts as
+// no time rather than a negative one.
+static int sampled_batch(Cpu_state *state, int budget, Counts *counts) {
+    uint8_t op_codes[SAMPLE_BATCH];
+    int ops = 0;
+    int cyc = 0;
+
+    double start = now();
+    while (ops < SAMPLE_BATCH && cyc < budget) {
+        op_codes[ops++] = read_memory(state, state->pc);
+        cyc += counted_op(state, counts);
+    }
+    double elapsed = now() - start - clock_overhead;
+
+    double share = elapsed > 0 ? elapsed * 1e9 / ops : 0;
+    for (int i = 0; i < ops; i++) {
+        counts->sampled_ns[op_codes[i]] += share;
+        counts->samples[op_codes[i]]++;
+    }
+
+    return cyc;
+}
+
+// Same contract as run_cycles
+static int counted_run(Cpu_state *state, int budget, Counts *counts) {
+    int cyc = 0;
+    while (cyc < budget) {
+        if ((counts->instructions & SAMPLE_MASK) == 0)
+            cyc += sampled_batch(state, budget - cyc, counts);
+        else
+            cyc += counted_op(state, counts);
+    }
+    return cyc - budget;
+}
+
+// -- CPUDIAG --
+//
+// Run on a paged build, so CP/M is stood in for by a BDOS that is just an OUT
+// to a port, and a warm boot that signals the end of the program.
+
+#if !FLAT_MEMORY
+typedef struct {
+    bool done;
+} Cpm_machine;
+
+// Mapped to port 0 only, console output is dropped
+static void cpm_OUT(void *context, uint8_t port, uint8_t value) {
+    (void)port;
+    (void)value;
+    ((Cpm_machine *)context)->done = true;
+}
+
+static void store(Cpu_state *state, uint16_t address, const uint8_t *data,
+        int size) {
+    for (int i = 0; i < size; i++)
+        write_memory(state, address + i, data[i]);
+}
+
+static void setup_cpm(Cpm_machine *machine, Cpu_state *state, uint8_t *image,
+        int size) {
+    static const uint8_t low_memory[] = {
+        0xd3, 0x00, // warm boot: OUT 0
+        0xc3, 0x02, 0x00, // JMP $-3
+        0xc3, 0x00, 0xff, // BDOS: JMP 0xff00, also read as the top of memory
+    };
+    static const uint8_t bdos[] = {
+        0xd3, 0x01, // OUT 1
+        0xc9, // RET
+    };
+
+    // Through write_memory, so that anything cached from the last run goes
+    for (uint32_t address = 0; address < 0x10000; address++)
+        write_memory(state, address, 0);
+    store(state, 0x0000, low_memory, sizeof(low_memory));
+    store(state, 0xff00, bdos, sizeof(bdos));
+    store(state, 0x0100, image, size);
+    write_memory(state, 368, 0x7); // fix CPUDIAG's stack pointer
+
+    state->pc = 0x100;
+    state->sp = 0;
+    write_flags(state, 0);
+    machine->done = false;
+}
+#endif
+
+// 64KB of RAM and nothing else
+static Cpu_state *new_ram_state() {
+    Cpu_state *state = calloc(1, sizeof(Cpu_state));
+    state->memory = calloc(1, 0x10000);
+#if !FLAT_MEMORY
+    clear_memory_map(state);
+    map_memory(state, 0x0000, 0x10000, state->memory, true);
+#endif
+    write_flags(state, 0);
+#if JIT
+    jit_init(state);
+#endif
+    return state;
+}
+
+static void free_ram_state(Cpu_state *state) {
+    jit_free(state);
+#if !FLAT_MEMORY
+    free_memory_map(state);
+#endif
+    free(state->memory);
+    free(state);
+}
+
+static void bench_cpudiag(Result *result, char *path) {
+    result->name = "cpudiag";
+
+#if FLAT_MEMORY
+    result->skipped = true;
+    result->reason = "needs the paged memory map";
+    (void)path;
+#else
+    if (!file_exists(path)) {
+        result->skipped = true;
+        result->reason = "ROM not found";
+        return;
+    }
+
+    static uint8_t image[0x10000 - 0x100];
+    FILE *f = fopen(path, "rb");
+    int size = fread(image, 1, sizeof(image), f);
+    fclose(f);
+
+    Cpu_state *state = new_ram_state();
+    Cpm_machine machine;
+    map_port_out(state, 0, cpm_OUT, &machine);
+
+    // Small slices, so little time is spent spinning after the warm boot
+    for (int i = 0; i < CPUDIAG_RUNS; i++) {
+        setup_cpm(&machine, state, image, size);
+        double start = now();
+        while (!machine.done)
+            jit_run_cycles(state, 64);
+        result->seconds += now() - start;
+    }
+
+    for (int i = 0; i < CPUDIAG_RUNS; i++) {
+        setup_cpm(&machine, state, image, size);
+        while (!machine.done)
+            counted_run(state, 64, &result->counts);
+    }
+    result->cycles = result->counts.cycles;
+
+    free_ram_state(state);
+#endif
+}
+
+// -- Synthetic ALU loop --
+
+static void bench_alu(Result *result) {
+    static const uint8_t program[] = {
+        0x31, 0x00, 0xf0, // LXI SP,0xf000
+        0x21, 0x34, 0x12, // LXI H,0x1234
+        0x11, 0x78, 0x56, // LXI D,0x5678
+        0x01, 0xbc, 0x9a, // LXI B,0x9abc
+        // loop:
+        0x80, 0x89, 0x92, 0x9b, // ADD B, ADC C, SUB D, SBB E
+        0xa4, 0xad, 0xb0, 0xb9, // ANA H, XRA L, ORA B, CMP C
+        0x04, 0x0d, 0x19, 0x07, // INR B, DCR C, DAD D, RLC
+        0x1f, 0x27, // RAR, DAA
+        0xc6, 0x11, // ADI 0x11
+        0xee, 0x5a, // XRI 0x5a
+        0xfe, 0x80, // CPI 0x80
+        0xda, 0x0c, 0x01, // JC loop
+        0xc3, 0x0c, 0x01, // JMP loop
+    };
+
+    result->name = "alu";
+
+    Cpu_state *state = new_ram_state();
+
+    memcpy(&state->memory[0x100], program, sizeof(program));
+    state->pc = 0x100;
+    double start = now();
+    result->cycles = ALU_CYCLES + jit_run_cycles(state, ALU_CYCLES);
+    result->seconds = now() - start;
+
+    memset(state->regs, 0, sizeof(state->regs));
+    write_flags(state, 0);
+    state->pc = 0x100;
+    counted_run(state, ALU_CYCLES, &result->counts);
+
+    free_ram_state(state);
+}
+
+// -- Space Invaders attract mode --
+
+static void bench_invaders(Result *result, char *rom_path, long frames) {
+    char filepath[100];
+
+    result->name = "invaders";
+    result->frames = frames;
+
+#if FLAT_MEMORY
+    result->skipped = true;
+    result->reason = "needs the paged memory map";
+    (void)rom_path;
+    (void)filepath;
+    return;
+#endif
+
+    snprintf(filepath, sizeof(filepath), "%s/invaders.h", rom_path);
+    if (!file_exists(filepath)) {
+        result->skipped = true;
+        result->reason = "ROM not found";
+        return;
+    }
+
+    Arcade_system system;
+    initialise_system(&system, rom_path);
+
+    double start = now();
+    for (long i = 0; i < frames; i++)
+        result->cycles += run_frame(&system);
+    result->seconds = now() - start;
+    free_system(&system);
+
+    // The same frames again, with interrupts at the same points as run_frame
+    initialise_system(&system, rom_path);
+    int cyc = 0;
+    for (long i = 0; i < frames; i++) {
+        cyc = counted_run(system.state, CYCLES_PER_HALF_FRAME - cyc,
+                &result->counts);
+        cyc += interrupt(system.state, 1);
+        cyc = counted_run(system.state, CYCLES_PER_HALF_FRAME - cyc,
+                &result->counts);
+        cyc += interrupt(system.state, 2);
+    }
+    free_system(&system);
+}
+
+// -- Report --
+
+static void print_result(Result *result, bool last) {
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", result->name);
+
+    if (result->skipped) {
+        printf("      \"skipped\": \"%s\"\n", result->reason);
+        printf("    }%s\n", last ? "" : ",");
+        return;
+    }
+
+    Counts *counts = &result->counts;
+
+    printf("      \"seconds\": %.6f,\n", result->seconds);
+    printf("      \"instructions\": %lld,\n", counts->instructions);
+    printf("      \"cycles\": %lld,\n", result->cycles);
+    printf("      \"mips\": %.3f,\n",
+            counts->instructions / result->seconds / 1e6);
+    printf("      \"cycles_per_sec\": %.0f,\n", result->cycles / result->seconds);
+    if (result->frames)
+        printf("      \"ns_per_frame\": %.0f,\n",
+                result->seconds * 1e9 / result->frames);
+    else
+        printf("      \"ns_per_frame\": null,\n");
+
+    // Sorted by share of the sampled host time
+    int order[0x100];
+    int ops = 0;
+    for (int op_code = 0; op_code < 0x100; op_code++) {
+        if (counts->count[op_code])
+            order[ops++] = op_code;
+    }
+    for (int i = 1; i < ops; i++) {
+        for (int j = i; j > 0 && counts->sampled_ns[order[j]]
+                > counts->sampled_ns[order[j - 1]]; j--) {
+            int swap = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = swap;
+        }
+    }
+
+    printf("      \"opcodes\": [\n");
+    for (int i = 0; i < ops; i++) {
+        int op_code = order[i];
+        double ns = counts->samples[op_code]
+            ? counts->sampled_ns[op_code] / counts->samples[op_code] : 0;
+
+        printf("        {\"op\": \"0x%02x\", \"count\": %lld, \"cycles\": %lld, "
+                "\"ns_per_op\": %.2f, \"samples\": %lld}%s\n",
+                op_code, counts->count[op_code], counts->op_cycles[op_code],
+                ns, counts->samples[op_code], i == ops - 1 ? "" : ",");
+    }
+    printf("      ]\n");
+    printf("    }%s\n", last ? "" : ",");
+}
+
+static void usage(char *name) {
+    printf("Usage: %s [-r rom directory] [-d cpudiag.bin] [-f frames]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char *rom_path = "rom";
+    char *cpudiag_path = "rom/cpudiag.bin";
+    long frames = 3600;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:d:f:")) != -1) {
+        switch (opt) {
+        case 'r':
+            rom_path = optarg;
+            break;
+        case 'd':
+            cpudiag_path = optarg;
+            break;
+        case 'f':
+            frames = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    clock_overhead = measure_clock_overhead();
+
+    static Result results[3];
+    bench_cpudiag(&results[0], cpudiag_path);
+    bench_alu(&results[1]);
+    bench_invaders(&results[2], rom_path, frames);
+
+    printf("{\n");
+    printf("  \"config\": {\"dispatch\": %d, \"lazy_flags\": %d, "
+            "\"decode_cache\": %d, \"jit\": %d},\n",
+            DISPATCH, LAZY_FLAGS, DECODE_CACHE, JIT);
+    printf("  \"clock_overhead_ns\": %.2f,\n", clock_overhead * 1e9);
+    printf("  \"workloads\": [\n");
+    for (int i = 0; i < 3; i++)
+        print_result(&results[i], i == 2);
+    printf("  ]\n");
+    printf("}\n");
+
+    return 0;
+}
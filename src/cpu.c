@@ -1,73 +1,429 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "cpu.h"
-#include "disassembler.h"
+#include "profile.h"
+#include "trace.h"
 
 // -- Helper functions --
 
 uint8_t read_memory(Cpu_state *state, uint16_t address) {
-    if (address >= 0x6000) {
-        printf("Tried to read outside memory buffer\n");
+#if FLAT_MEMORY
+    return state->memory[address];
+#else
+    uint8_t *page = state->map.read[address >> PAGE_SHIFT];
+
+    if (page)
+        return page[address & PAGE_MASK];
+
+    return state->map.read_handler[address >> PAGE_SHIFT](state, address);
+#endif
+}
+
+void write_memory(Cpu_state *state, uint16_t address, uint8_t value) {
+#if FLAT_MEMORY
+    state->memory[address] = value;
+#else
+    uint8_t *page = state->map.write[address >> PAGE_SHIFT];
+
+    if (page)
+        page[address & PAGE_MASK] = value;
+    else
+        state->map.write_handler[address >> PAGE_SHIFT](state, address, value);
+#endif
+}
+
+// -- Memory map --
+
+#if !FLAT_MEMORY
+static uint8_t unmapped_read(Cpu_state *state, uint16_t address) {
+    (void)state;
+    printf("Tried to read outside memory buffer: %04x\n", address);
+    exit(1);
+}
+
+static void ignored_write(Cpu_state *state, uint16_t address, uint8_t value) {
+    (void)state;
+    (void)address;
+    (void)value;
+}
+
+static void check_page_range(uint16_t address, uint32_t size) {
+    if ((address & PAGE_MASK) || (size & PAGE_MASK)
+            || address + size > 0x10000) {
+        printf("Memory map range %04x+%x is not page aligned\n", address, size);
         exit(1);
     }
+}
 
-    if (address >= 0x4000 && address < 0x6000) {
-        address -= 0x2000; // Mirror RAM
+// A shared decode cache is let go of rather than cleared
+static void drop_decoded(Cpu_state *state, int page) {
+    if (state->map.shared_decoded[page]) {
+        state->map.decoded[page] = NULL;
+        state->map.shared_decoded[page] = false;
+    } else if (state->map.decoded[page]) {
+        memset(state->map.decoded[page], 0, PAGE_SIZE * sizeof(Decoded));
     }
+}
 
-    return state->memory[address];
+// Sets up the map of a new state, reads then abort and writes are ignored
+void clear_memory_map(Cpu_state *state) {
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        state->map.read[page] = NULL;
+        state->map.write[page] = NULL;
+        state->map.read_handler[page] = unmapped_read;
+        state->map.write_handler[page] = ignored_write;
+        state->map.traps[page] = 0;
+        state->map.dirty[page] = 0;
+        state->map.decoded[page] = NULL;
+        state->map.shared_decoded[page] = false;
+    }
 }
 
-void write_memory(Cpu_state *state, uint16_t address, uint8_t value) {
-    if (address >= 0x2000) {
-        if (address >= 0x4000 && address < 0x6000) {
-            address -= 0x2000; // Mirror RAM
+// Frees the decode cache
+void free_memory_map(Cpu_state *state) {
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (!state->map.shared_decoded[page])
+            free(state->map.decoded[page]);
+        state->map.decoded[page] = NULL;
+        state->map.shared_decoded[page] = false;
+    }
+}
+
+// Backs an address range with host memory, writes are ignored if read-only
+void map_memory(Cpu_state *state, uint16_t address, uint32_t size,
+        uint8_t *memory, bool writable) {
+    check_page_range(address, size);
+
+    for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        int page = (address + offset) >> PAGE_SHIFT;
+        state->map.read[page] = &memory[offset];
+        state->map.write[page] = writable ? &memory[offset] : NULL;
+        state->map.write_handler[page] = ignored_write;
+        state->map.traps[page] = 0;
+        drop_decoded(state, page);
+    }
+}
+
+// Services an address range with handlers, e.g. for memory mapped IO
+void map_handlers(Cpu_state *state, uint16_t address, uint32_t size,
+        Read_handler read, Write_handler write) {
+    check_page_range(address, size);
+
+    for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        int page = (address + offset) >> PAGE_SHIFT;
+        state->map.read[page] = NULL;
+        state->map.write[page] = NULL;
+        state->map.read_handler[page] = read ? read : unmapped_read;
+        state->map.write_handler[page] = write ? write : ignored_write;
+        state->map.traps[page] = 0;
+        drop_decoded(state, page);
+    }
+}
+
+// -- Write traps --
+//
+// A trapped page has its write pointer stashed in map.trapped, so that its
+// next write goes through trapped_write. That springs every trap on the page,
+// and on the pages mirroring it, and puts the write pointer back.
+
+#define TRAP_CODE 0x01 // drop anything decoded or translated from the page
+#define TRAP_DIRTY 0x02 // set map.dirty
+
+static void trapped_write(Cpu_state *state, uint16_t address, uint8_t value);
+
+static void set_trap(Cpu_state *state, int page, uint8_t trap) {
+    uint8_t *memory = state->map.read[page];
+
+    if (!memory || (state->map.traps[page] & trap) == trap)
+        return; // handled or already trapped
+    if (!state->map.write[page] && !state->map.traps[page])
+        return; // read-only
+
+    for (int alias = 0; alias < PAGE_COUNT; alias++) {
+        if (state->map.read[alias] != memory)
+            continue;
+
+        if (!state->map.traps[alias]) {
+            if (!state->map.write[alias])
+                continue;
+            state->map.trapped[alias] = state->map.write[alias];
+            state->map.write[alias] = NULL;
+            state->map.write_handler[alias] = trapped_write;
         }
-        state->memory[address] = value;
+        state->map.traps[alias] |= trap;
     }
 }
 
-uint8_t check_parity(uint8_t res, int bits) {
-    int p = 0;
-    for (int i = 0; i < bits; i++) {
-        if ((res >> i) & 0x01)
-            p++;
+static void spring_traps(Cpu_state *state, int page) {
+    uint8_t *memory = state->map.read[page];
+
+    for (int alias = 0; alias < PAGE_COUNT; alias++) {
+        uint8_t traps = state->map.traps[alias];
+
+        if (state->map.read[alias] != memory || !traps)
+            continue;
+
+        state->map.write[alias] = state->map.trapped[alias];
+        state->map.write_handler[alias] = ignored_write;
+        state->map.traps[alias] = 0;
+
+        if (traps & TRAP_CODE) {
+            drop_decoded(state, alias);
+            if (state->code_written)
+                state->code_written(state, alias);
+        }
+        if (traps & TRAP_DIRTY)
+            state->map.dirty[alias] = 0xff; // for every tracker
     }
-    return ((p & 0x1) == 0);
 }
 
-void set_zsp(Cpu_state *state, uint8_t res) {
-    state->cc.z = (res == 0x00);
-    state->cc.s = ((res & 0x80) == 0x80);
-    state->cc.p = check_parity(res, 8);
+static void trapped_write(Cpu_state *state, uint16_t address, uint8_t value) {
+    spring_traps(state, address >> PAGE_SHIFT);
+    write_memory(state, address, value);
 }
 
-uint16_t get_m_address(Cpu_state *state, uint8_t reg1, uint8_t reg2) {
-    return (state->regs[reg1] << 8) | state->regs[reg2];
+// Traps the next write to a RAM page, and to the pages mirroring it, so that
+// anything decoded or translated from it can be dropped via code_written
+void watch_code_page(Cpu_state *state, int page) {
+    set_trap(state, page, TRAP_CODE);
+}
+
+// Clears a tracker's bit of map.dirty for a range, then traps the next write
+// to each page so that it gets set again. Each user of dirty tracking has its
+// own tracker bit, so they can clear them independently. Writes cost nothing
+// extra once a page is dirty.
+void track_dirty_pages(Cpu_state *state, uint16_t address, uint32_t size,
+        int tracker) {
+    check_page_range(address, size);
+
+    for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        int page = (address + offset) >> PAGE_SHIFT;
+
+        state->map.dirty[page] &= ~(1 << tracker);
+        set_trap(state, page, TRAP_DIRTY);
+    }
 }
 
-uint16_t get_immediate_address(Cpu_state *state) {
-    uint8_t byte1 = read_memory(state, state->pc + 2);
-    uint8_t byte2 = read_memory(state, state->pc + 1);
-    return (byte1 << 8) | byte2;
+// Decodes a page of read-only memory ahead of time, into a table any number
+// of states can share with map_decoded. Instructions running off the end of
+// the page are left to be decoded as they're run.
+void decode_page(const uint8_t *memory, Decoded decoded[PAGE_SIZE]) {
+    for (int offset = 0; offset < PAGE_SIZE; offset++) {
+        uint8_t op_code = memory[offset];
+        int length = op_length[op_code];
+
+        if (offset + length > PAGE_SIZE) {
+            decoded[offset] = (Decoded){0};
+            continue;
+        }
+
+        decoded[offset].op_code = op_code;
+        decoded[offset].length = length;
+        decoded[offset].handler = op_table[op_code];
+        decoded[offset].operand = length == 3
+            ? memory[offset + 1] | (memory[offset + 2] << 8)
+            : length == 2 ? memory[offset + 1] : 0;
+    }
+}
+
+// Uses a table from decode_page as a read-only page's decode cache, in place
+// of one of the state's own. The table is never written or freed through it.
+void map_decoded(Cpu_state *state, int page, Decoded *decoded) {
+    if (!state->map.read[page] || state->map.write[page] || state->map.traps[page]) {
+        printf("Only read-only pages can share a decode cache\n");
+        exit(1);
+    }
+
+    drop_decoded(state, page); // lets go of a shared one
+    free(state->map.decoded[page]);
+
+    state->map.decoded[page] = decoded;
+    state->map.shared_decoded[page] = true;
+}
+
+// For memory changed behind write_memory's back, e.g. by restoring a
+// snapshot. Drops anything decoded or translated from the range.
+void flush_code(Cpu_state *state, uint16_t address, uint32_t size) {
+    check_page_range(address, size);
+
+    for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        int page = (address + offset) >> PAGE_SHIFT;
+
+        if (state->map.traps[page])
+            spring_traps(state, page);
+        drop_decoded(state, page);
+    }
+}
+#endif
+
+// Z, S and P flags for every possible result, in their PSW bit positions
+const uint8_t zsp_table[0x100] = {
+    0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+};
+
+// -- Flags --
+//
+// With LAZY_FLAGS set, the flag-producing instructions only record what they
+// did, and the flags are worked out when something actually reads them:
+//
+// LAZY_NONE: flags holds every flag
+// LAZY_ZSP: flags holds CY and AC, Z, S and P come from lazy_res
+// LAZY_ADD: all flags come from lazy_res = lazy_a + lazy_b (+ carry)
+// LAZY_SUB: as LAZY_ADD, but lazy_b is complemented and CY is inverted
+
+enum Lazy_op {
+    LAZY_NONE,
+    LAZY_ZSP,
+    LAZY_ADD,
+    LAZY_SUB,
+};
+
+static uint8_t get_flags(Cpu_state *state) {
+#if LAZY_FLAGS
+    uint16_t res = state->lazy_res;
+
+    switch (state->lazy_op) {
+    case LAZY_ZSP:
+        state->flags |= zsp_table[res & 0xff];
+        break;
+    case LAZY_ADD:
+        state->flags = zsp_table[res & 0xff]
+            | ((res >> 8) & FLAG_CY)
+            | ((state->lazy_a ^ state->lazy_b ^ res) & FLAG_AC)
+            | FLAG_ONE;
+        break;
+    case LAZY_SUB:
+        state->flags = zsp_table[res & 0xff]
+            | (~(res >> 8) & FLAG_CY)
+            | ((state->lazy_a ^ state->lazy_b ^ res) & FLAG_AC)
+            | FLAG_ONE;
+        break;
+    }
+
+    state->lazy_op = LAZY_NONE;
+#endif
+    return state->flags;
+}
+
+static uint8_t get_carry(Cpu_state *state) {
+#if LAZY_FLAGS
+    switch (state->lazy_op) {
+    case LAZY_ADD: return (state->lazy_res >> 8) & FLAG_CY;
+    case LAZY_SUB: return ~(state->lazy_res >> 8) & FLAG_CY;
+    }
+#endif
+    return state->flags & FLAG_CY;
+}
+
+// Sets every flag from an ALU result, Z, S and P coming from the result
+static void set_flags(Cpu_state *state, uint8_t res, bool cy, bool ac) {
+#if LAZY_FLAGS
+    state->flags = (cy ? FLAG_CY : 0) | (ac ? FLAG_AC : 0) | FLAG_ONE;
+    state->lazy_op = LAZY_ZSP;
+    state->lazy_res = res;
+#else
+    state->flags = zsp_table[res]
+        | (cy ? FLAG_CY : 0)
+        | (ac ? FLAG_AC : 0)
+        | FLAG_ONE;
+#endif
+}
+
+// Sets every flag from res = a + b, or a + b + 1
+static void set_add_flags(Cpu_state *state, uint8_t a, uint8_t b, uint16_t res) {
+#if LAZY_FLAGS
+    state->lazy_op = LAZY_ADD;
+    state->lazy_a = a;
+    state->lazy_b = b;
+    state->lazy_res = res;
+#else
+    set_flags(state, res & 0xff, (res & 0x100) != 0, ((a ^ b ^ res) & 0x10) != 0);
+#endif
+}
+
+// Sets every flag from res = a + b + 1, b being the complemented subtrahend
+static void set_sub_flags(Cpu_state *state, uint8_t a, uint8_t b, uint16_t res) {
+#if LAZY_FLAGS
+    state->lazy_op = LAZY_SUB;
+    state->lazy_a = a;
+    state->lazy_b = b;
+    state->lazy_res = res;
+#else
+    set_flags(state, res & 0xff, (res & 0x100) == 0, ((a ^ b ^ res) & 0x10) != 0);
+#endif
+}
+
+static void set_cy(Cpu_state *state, bool cy) {
+#if LAZY_FLAGS
+    if (state->lazy_op == LAZY_ADD || state->lazy_op == LAZY_SUB)
+        get_flags(state);
+#endif
+    state->flags = (state->flags & ~FLAG_CY) | (cy ? FLAG_CY : 0);
+}
+
+uint8_t read_flags(Cpu_state *state) {
+    return get_flags(state);
+}
+
+void write_flags(Cpu_state *state, uint8_t flags) {
+    state->flags = (flags & FLAG_MASK) | FLAG_ONE;
+#if LAZY_FLAGS
+    state->lazy_op = LAZY_NONE;
+#endif
+}
+
+static uint16_t get_m_address(Cpu_state *state, uint8_t reg1, uint8_t reg2) {
+    return (state->regs[reg1] << 8) | state->regs[reg2];
 }
 
 // -- Carry bit instructions --
 
-int STC(Cpu_state *state) {
-    state->cc.cy = 1;
+static int STC(Cpu_state *state) {
+    set_cy(state, 1);
     return 4;
 }
 
-int CMC(Cpu_state *state) {
-    state->cc.cy = !state->cc.cy;
+static int CMC(Cpu_state *state) {
+    set_cy(state, !get_carry(state));
     return 4;
 }
 
 // -- Single register instructions --
 
-int INR(Cpu_state *state, uint8_t reg) {
+static int INR(Cpu_state *state, uint8_t reg) {
     int cyc = 5;
     uint8_t res;
 
@@ -81,12 +437,11 @@ int INR(Cpu_state *state, uint8_t reg) {
         res = ++state->regs[reg];
     }
 
-    set_zsp(state, res);
-    state->cc.ac = ((res & 0x0f) == 0x00);
+    set_flags(state, res, get_carry(state), (res & 0x0f) == 0x00);
     return cyc;
 }
 
-int DCR(Cpu_state *state, uint8_t reg) {
+static int DCR(Cpu_state *state, uint8_t reg) {
     int cyc = 5;
     uint8_t res;
 
@@ -100,24 +455,25 @@ int DCR(Cpu_state *state, uint8_t reg) {
         res = --state->regs[reg];
     }
 
-    set_zsp(state, res);
-    state->cc.ac = !((res & 0x0f) == 0x0f);
+    set_flags(state, res, get_carry(state), !((res & 0x0f) == 0x0f));
     return cyc;
 }
 
-int CMA(Cpu_state *state) {
+static int CMA(Cpu_state *state) {
     state->regs[A] = ~state->regs[A];
     return 4;
 }
 
-int DAA(Cpu_state *state) {
-    if (state->cc.ac || (state->regs[A] & 0x0f) > 9) {
-        state->cc.ac = 1;
+static int DAA(Cpu_state *state) {
+    get_flags(state); // resolved, state->flags can be used directly
+
+    if ((state->flags & FLAG_AC) || (state->regs[A] & 0x0f) > 9) {
+        state->flags |= FLAG_AC;
         state->regs[A] += 6;
     }
 
-    if (state->cc.cy || (state->regs[A] >> 4) > 9) {
-        state->cc.cy = 1;
+    if ((state->flags & FLAG_CY) || (state->regs[A] >> 4) > 9) {
+        state->flags |= FLAG_CY;
         state->regs[A] = ((state->regs[A] & 0xf0) + (6 << 4)) + (state->regs[A] &0x0f);
     }
 
@@ -126,7 +482,7 @@ int DAA(Cpu_state *state) {
 
 // -- Data transfer instructions --
 
-int MOV(Cpu_state *state, uint8_t reg1, uint8_t reg2) {
+static int MOV(Cpu_state *state, uint8_t reg1, uint8_t reg2) {
     int cyc = 5;
     uint8_t byte;
 
@@ -151,14 +507,14 @@ int MOV(Cpu_state *state, uint8_t reg1, uint8_t reg2) {
     return cyc;
 }
 
-int STAX(Cpu_state *state, uint8_t reg) {
+static int STAX(Cpu_state *state, uint8_t reg) {
     uint16_t address = get_m_address(state, reg, reg + 1);
     write_memory(state, address, state->regs[A]);
 
     return 7;
 }
 
-int LDAX(Cpu_state *state, uint8_t reg) {
+static int LDAX(Cpu_state *state, uint8_t reg) {
     uint16_t address = get_m_address(state, reg, reg + 1);
     state->regs[A] = read_memory(state, address);
 
@@ -167,7 +523,7 @@ int LDAX(Cpu_state *state, uint8_t reg) {
 
 // -- Register or memory to accumulator instructions --
 
-int ADD(Cpu_state *state, uint8_t reg) {
+static int ADD(Cpu_state *state, uint8_t reg) {
     int cyc = 4;
     uint8_t add1 = state->regs[A];
     uint8_t add2;
@@ -181,20 +537,16 @@ int ADD(Cpu_state *state, uint8_t reg) {
         add2 = state->regs[reg];
     }
 
-    state->cc.ac = (((add1 & 0x0f) + (add2 & 0x0f)) & 0xf0) != 0;
-
     uint16_t res = add1 + add2;
 
-    state->cc.cy = (res & 0x0f00) != 0;
-
     state->regs[A] = res & 0xff;
 
-    set_zsp(state, state->regs[A]);
+    set_add_flags(state, add1, add2, res);
 
     return cyc;
 }
 
-int ADC(Cpu_state *state, uint8_t reg) {
+static int ADC(Cpu_state *state, uint8_t reg) {
     int cyc = 4;
     uint8_t add1 = state->regs[A];
     uint8_t add2;
@@ -208,20 +560,16 @@ int ADC(Cpu_state *state, uint8_t reg) {
         add2 = state->regs[reg];
     }
 
-    state->cc.ac = (((add1 & 0x0f) + (add2 & 0x0f) + state->cc.cy) & 0xf0) != 0;
-
-    uint16_t res = add1 + add2 + state->cc.cy;
-
-    state->cc.cy = (res & 0x0f00) != 0;
+    uint16_t res = add1 + add2 + get_carry(state);
 
     state->regs[A] = res & 0xff;
 
-    set_zsp(state, state->regs[A]);
+    set_add_flags(state, add1, add2, res);
 
     return cyc;
 }
 
-int SUB(Cpu_state *state, uint8_t reg) {
+static int SUB(Cpu_state *state, uint8_t reg) {
     int cyc = 4;
     uint8_t sub1 = state->regs[A];
     uint8_t sub2;
@@ -235,20 +583,16 @@ int SUB(Cpu_state *state, uint8_t reg) {
         sub2 = ~state->regs[reg];
     }
 
-    state->cc.ac = (((sub1 & 0x0f) + (sub2 & 0x0f) + 1) & 0xf0) != 0;
-
     uint16_t res = sub1 + sub2 + 1;
 
-    state->cc.cy = (res & 0x0f00) == 0;
-
     state->regs[A] = res & 0xff;
 
-    set_zsp(state, state->regs[A]);
+    set_sub_flags(state, sub1, sub2, res);
 
     return cyc;
 }
 
-int SBB(Cpu_state *state, uint8_t reg) {
+static int SBB(Cpu_state *state, uint8_t reg) {
     int cyc = 4;
     uint8_t sub1 = state->regs[A];
     uint8_t sub2;
@@ -262,20 +606,16 @@ int SBB(Cpu_state *state, uint8_t reg) {
         sub2 = ~(state->regs[reg] + 1);
     }
 
-    state->cc.ac = (((sub1 & 0x0f) + (sub2 & 0x0f) + 1) & 0xf0) != 0;
-
     uint16_t res = sub1 + sub2 + 1;
 
-    state->cc.cy = (res & 0x0f00) == 0;
-
     state->regs[A] = res & 0xff;
 
-    set_zsp(state, state->regs[A]);
+    set_sub_flags(state, sub1, sub2, res);
 
     return cyc;
 }
 
-int ANA(Cpu_state *state, uint8_t reg) {
+static int ANA(Cpu_state *state, uint8_t reg) {
     int cyc = 4;
     uint8_t and;
     if (reg == M) {
@@ -287,17 +627,16 @@ int ANA(Cpu_state *state, uint8_t reg) {
         and = state->regs[reg];
     }
 
-    state->cc.ac = ((state->regs[A] | and) & 0x08) != 0;
+    bool ac = ((state->regs[A] | and) & 0x08) != 0;
 
     state->regs[A] = state->regs[A] & and;
 
-    state->cc.cy = 0;
-    set_zsp(state, state->regs[A]);
+    set_flags(state, state->regs[A], 0, ac);
 
     return cyc;
 }
 
-int XRA(Cpu_state *state, uint8_t reg) {
+static int XRA(Cpu_state *state, uint8_t reg) {
     int cyc = 4;
     uint8_t xor;
     if (reg == M) {
@@ -311,14 +650,12 @@ int XRA(Cpu_state *state, uint8_t reg) {
 
     state->regs[A] = state->regs[A] ^ xor;
 
-    state->cc.cy = 0;
-    state->cc.ac = 0;
-    set_zsp(state, state->regs[A]);
+    set_flags(state, state->regs[A], 0, 0);
 
     return cyc;
 }
 
-int ORA(Cpu_state *state, uint8_t reg) {
+static int ORA(Cpu_state *state, uint8_t reg) {
     int cyc = 4;
     uint8_t or;
     if (reg == M) {
@@ -331,14 +668,12 @@ int ORA(Cpu_state *state, uint8_t reg) {
 
     state->regs[A] = state->regs[A] | or;
 
-    state->cc.cy = 0;
-    state->cc.ac = 0;
-    set_zsp(state, state->regs[A]);
+    set_flags(state, state->regs[A], 0, 0);
 
     return cyc;
 }
 
-int CMP(Cpu_state *state, uint8_t reg) {
+static int CMP(Cpu_state *state, uint8_t reg) {
     int cyc = 4;
     uint8_t cmp1 = state->regs[A];
     uint8_t cmp2;
@@ -353,43 +688,40 @@ int CMP(Cpu_state *state, uint8_t reg) {
     }
 
     // might be wrong... data book didn't specify the behaviour
-    int16_t sub = cmp1 - ~cmp2;
-    state->cc.ac = (~(cmp1 ^ sub ^ ~cmp2) & 0x10) != 0;
-
     uint16_t res = cmp1 + cmp2 + 1;
 
-    state->cc.cy = (res & 0x0f00) == 0;
-
-    set_zsp(state, res & 0xff);
+    set_sub_flags(state, cmp1, cmp2, res);
 
     return cyc;
 }
 
 // -- Rotate accumulator instructions --
 
-int RLC(Cpu_state *state) {
-    state->cc.cy = (state->regs[A] & 0x80) != 0;
+static int RLC(Cpu_state *state) {
+    bool cy = (state->regs[A] & 0x80) != 0;
+    set_cy(state, cy);
 
     state->regs[A] <<= 1;
-    if (state->cc.cy)
+    if (cy)
         state->regs[A]++;
 
     return 4;
 }
 
-int RRC(Cpu_state *state) {
-    state->cc.cy = (state->regs[A] & 0x01) != 0;
+static int RRC(Cpu_state *state) {
+    bool cy = (state->regs[A] & 0x01) != 0;
+    set_cy(state, cy);
 
     state->regs[A] >>= 1;
-    if (state->cc.cy)
+    if (cy)
         state->regs[A] += 0x80;
 
     return 4;
 }
 
-int RAL(Cpu_state *state) {
-    uint8_t oldcy = state->cc.cy;
-    state->cc.cy = (state->regs[A] & 0x80) != 0;
+static int RAL(Cpu_state *state) {
+    uint8_t oldcy = get_carry(state);
+    set_cy(state, (state->regs[A] & 0x80) != 0);
 
     state->regs[A] <<= 1;
     state->regs[A] += oldcy;
@@ -397,9 +729,9 @@ int RAL(Cpu_state *state) {
     return 4;
 }
 
-int RAR(Cpu_state *state) {
-    uint8_t oldcy = state->cc.cy;
-    state->cc.cy = (state->regs[A] & 0x01) != 0;
+static int RAR(Cpu_state *state) {
+    uint8_t oldcy = get_carry(state);
+    set_cy(state, (state->regs[A] & 0x01) != 0);
 
     state->regs[A] >>= 1;
     state->regs[A] += (oldcy * 0x80);
@@ -409,17 +741,12 @@ int RAR(Cpu_state *state) {
 
 // -- Register pair instructions --
 
-int PUSH(Cpu_state *state, uint8_t reg) {
+static int PUSH(Cpu_state *state, uint8_t reg) {
     uint8_t byte1;
     uint8_t byte2;
     if (reg == PSW) {
         byte1 = state->regs[A];
-        byte2 = (state->cc.s << 7)
-            | (state->cc.z << 6)
-            | (state->cc.ac << 4)
-            | (state->cc.p << 2)
-            | (1 << 1)
-            | (state->cc.cy);
+        byte2 = get_flags(state);
     } else {
         byte1 = state->regs[reg];
         byte2 = state->regs[reg + 1];
@@ -433,17 +760,13 @@ int PUSH(Cpu_state *state, uint8_t reg) {
     return 11;
 }
 
-int POP(Cpu_state *state, uint8_t reg) {
+static int POP(Cpu_state *state, uint8_t reg) {
     uint8_t byte1 = read_memory(state, state->sp + 1);
     uint8_t byte2 = read_memory(state, state->sp);
 
     if (reg == PSW) {
         //bytes are reversed from what the data book says, but it seems right
-        state->cc.s = byte2 >> 7;
-        state->cc.z = (byte2 >> 6) & 1;
-        state->cc.ac = (byte2 >> 4) & 1;
-        state->cc.p = (byte2 >> 2) & 1;
-        state->cc.cy = byte2 & 1;
+        write_flags(state, byte2);
 
         state->regs[A] = byte1;
     } else {
@@ -456,7 +779,7 @@ int POP(Cpu_state *state, uint8_t reg) {
     return 10;
 }
 
-int DAD(Cpu_state *state, uint8_t reg) {
+static int DAD(Cpu_state *state, uint8_t reg) {
     uint16_t add1;
     if (reg == SP) {
         add1 = state->sp;
@@ -467,7 +790,7 @@ int DAD(Cpu_state *state, uint8_t reg) {
 
     uint32_t sum = add1 + add2;
 
-    state->cc.cy = ((sum & 0x00010000) != 0);
+    set_cy(state, (sum & 0x00010000) != 0);
 
     if(reg == SP) {
         state->sp = sum & 0xff;
@@ -479,7 +802,7 @@ int DAD(Cpu_state *state, uint8_t reg) {
     return 10;
 }
 
-int INX(Cpu_state *state, uint8_t reg) {
+static int INX(Cpu_state *state, uint8_t reg) {
     if (reg == SP) {
         state->sp++;
     } else {
@@ -490,7 +813,7 @@ int INX(Cpu_state *state, uint8_t reg) {
     return 5;
 }
 
-int DCX(Cpu_state *state, uint8_t reg) {
+static int DCX(Cpu_state *state, uint8_t reg) {
     if (reg == SP) {
         state->sp--;
     } else {
@@ -501,7 +824,7 @@ int DCX(Cpu_state *state, uint8_t reg) {
     return 5;
 }
 
-int XCHG(Cpu_state *state) {
+static int XCHG(Cpu_state *state) {
     uint8_t d_data = state->regs[D];
     uint8_t e_data = state->regs[E];
 
@@ -514,7 +837,7 @@ int XCHG(Cpu_state *state) {
     return 4;
 }
 
-int XTHL(Cpu_state *state) {
+static int XTHL(Cpu_state *state) {
     uint8_t l_data = state->regs[L];
     uint8_t h_data = state->regs[H];
 
@@ -527,22 +850,19 @@ int XTHL(Cpu_state *state) {
     return 18;
 }
 
-int SPHL(Cpu_state *state) {
+static int SPHL(Cpu_state *state) {
     state->sp = (state->regs[H] << 8) | state->regs[L];
     return 5;
 }
 
 // -- Immediate instructions --
 
-int LXI(Cpu_state *state, uint8_t reg) {
-    uint8_t byte1 = read_memory(state, state->pc + 1);
-    uint8_t byte2 = read_memory(state, state->pc + 2);
-
+static int LXI(Cpu_state *state, uint8_t reg, uint16_t data) {
     if (reg == SP) {
-        state->sp = (byte2 << 8) | byte1;
+        state->sp = data;
     } else {
-        state->regs[reg] = byte2;
-        state->regs[reg + 1] = byte1;
+        state->regs[reg] = data >> 8;
+        state->regs[reg + 1] = data & 0xff;
     }
 
     state->pc += 2;
@@ -550,17 +870,16 @@ int LXI(Cpu_state *state, uint8_t reg) {
     return 10;
 }
 
-int MVI(Cpu_state *state, uint8_t reg) {
+static int MVI(Cpu_state *state, uint8_t reg, uint8_t data) {
     int cyc = 7;
-    uint8_t byte = read_memory(state, state->pc + 1);
 
     if (reg == M) {
         cyc = 10;
 
         uint16_t address = get_m_address(state, H, L);
-        write_memory(state, address, byte);
+        write_memory(state, address, data);
     } else {
-        state->regs[reg] = byte;
+        state->regs[reg] = data;
     }
 
     state->pc++;
@@ -568,133 +887,108 @@ int MVI(Cpu_state *state, uint8_t reg) {
     return cyc;
 }
 
-int ADI(Cpu_state *state) {
+static int ADI(Cpu_state *state, uint8_t data) {
     uint8_t add1 = state->regs[A];
-    uint8_t add2 = read_memory(state, state->pc + 1);
-
-    state->cc.ac = (((add1 & 0x0f) + (add2 & 0x0f)) & 0xf0) != 0;
+    uint8_t add2 = data;
 
     uint16_t res = add1 + add2;
 
-    state->cc.cy = (res & 0x0f00) != 0;
-
     state->regs[A] = res & 0xff;
 
-    set_zsp(state, state->regs[A]);
+    set_add_flags(state, add1, add2, res);
 
     state->pc++;
 
     return 7;
 }
 
-int ACI(Cpu_state *state) {
+static int ACI(Cpu_state *state, uint8_t data) {
     uint8_t add1 = state->regs[A];
-    uint8_t add2 = read_memory(state, state->pc + 1);
-
-    state->cc.ac = (((add1 & 0x0f) + (add2 & 0x0f) + 1) & 0xf0) != 0;
+    uint8_t add2 = data;
 
     uint16_t res = add1 + add2 + 1;
 
-    state->cc.cy = (res & 0x0f00) != 0;
-
     state->regs[A] = res & 0xff;
 
-    set_zsp(state, state->regs[A]);
+    set_add_flags(state, add1, add2, res);
 
     state->pc++;
 
     return 7;
 }
 
-int SUI(Cpu_state *state) {
+static int SUI(Cpu_state *state, uint8_t data) {
     uint8_t sub1 = state->regs[A];
-    uint8_t sub2 = ~read_memory(state, state->pc + 1);
-
-    state->cc.ac = (((sub1 & 0x0f) + (sub2 & 0x0f) + 1) & 0xf0) != 0;
+    uint8_t sub2 = ~data;
 
     uint16_t res = sub1 + sub2 + 1;
 
-    state->cc.cy = (res & 0x0f00) == 0;
-
     state->regs[A] = res & 0xff;
 
-    set_zsp(state, state->regs[A]);
+    set_sub_flags(state, sub1, sub2, res);
 
     state->pc++;
 
     return 7;
 }
 
-int SBI(Cpu_state *state) {
+static int SBI(Cpu_state *state, uint8_t data) {
     uint8_t sub1 = state->regs[A];
-    uint8_t sub2 = ~(read_memory(state, state->pc + 1) + state->cc.cy);
-
-    state->cc.ac = (((sub1 & 0x0f) + (sub2 & 0x0f) + 1) & 0xf0) != 0;
+    uint8_t sub2 = ~(data + get_carry(state));
 
     uint16_t res = sub1 + sub2 + 1;
 
-    state->cc.cy = (res & 0x0f00) == 0;
-
     state->regs[A] = res & 0xff;
 
-    set_zsp(state, state->regs[A]);
+    set_sub_flags(state, sub1, sub2, res);
 
     state->pc++;
 
     return 7;
 }
 
-int ANI(Cpu_state *state) {
-    uint8_t and = read_memory(state, state->pc + 1);
+static int ANI(Cpu_state *state, uint8_t data) {
+    uint8_t and = data;
 
-    state->cc.ac = ((state->regs[A] | and) & 0x08) != 0;
+    bool ac = ((state->regs[A] | and) & 0x08) != 0;
 
     state->regs[A] = state->regs[A] & and;
 
-    state->cc.cy = 0;
-    set_zsp(state, state->regs[A]);
+    set_flags(state, state->regs[A], 0, ac);
 
     state->pc++;
 
     return 7;
 }
 
-int XRI(Cpu_state *state) {
-    state->regs[A] = state->regs[A] ^ read_memory(state, state->pc + 1);
+static int XRI(Cpu_state *state, uint8_t data) {
+    state->regs[A] = state->regs[A] ^ data;
 
-    state->cc.cy = 0;
-    set_zsp(state, state->regs[A]);
+    set_flags(state, state->regs[A], 0, get_flags(state) & FLAG_AC);
 
     state->pc++;
 
     return 7;
 }
 
-int ORI(Cpu_state *state) {
-    state->regs[A] = state->regs[A] | read_memory(state, state->pc + 1);
+static int ORI(Cpu_state *state, uint8_t data) {
+    state->regs[A] = state->regs[A] | data;
 
-    state->cc.cy = 0;
-    state->cc.ac = 0;
-    set_zsp(state, state->regs[A]);
+    set_flags(state, state->regs[A], 0, 0);
 
     state->pc++;
 
     return 7;
 }
 
-int CPI(Cpu_state *state) {
+static int CPI(Cpu_state *state, uint8_t data) {
     uint8_t cmp1 = state->regs[A];
-    uint8_t cmp2 = ~read_memory(state, state->pc + 1);
+    uint8_t cmp2 = ~data;
 
     // might be wrong... data book didn't specify the behaviour
-    int16_t sub = cmp1 - ~cmp2;
-    state->cc.ac = (~(cmp1 ^ sub ^ ~cmp2) & 0x10) != 0;
-
     uint16_t res = cmp1 + cmp2 + 1;
 
-    state->cc.cy = (res & 0x0f00) == 0;
-
-    set_zsp(state, res & 0xff);
+    set_sub_flags(state, cmp1, cmp2, res);
 
     state->pc++;
 
@@ -703,8 +997,7 @@ int CPI(Cpu_state *state) {
 
 // -- Direct addressing instructions --
 
-int STA(Cpu_state *state) {
-    uint16_t address = get_immediate_address(state);
+static int STA(Cpu_state *state, uint16_t address) {
     write_memory(state, address, state->regs[A]);
 
     state->pc += 2;
@@ -712,8 +1005,7 @@ int STA(Cpu_state *state) {
     return 13;
 }
 
-int LDA(Cpu_state *state) {
-    uint16_t address = get_immediate_address(state);
+static int LDA(Cpu_state *state, uint16_t address) {
     state->regs[A] = read_memory(state, address);
 
     state->pc += 2;
@@ -721,8 +1013,7 @@ int LDA(Cpu_state *state) {
     return 13;
 }
 
-int SHLD(Cpu_state *state) {
-    uint16_t address = get_immediate_address(state);
+static int SHLD(Cpu_state *state, uint16_t address) {
     write_memory(state, address, state->regs[L]);
     write_memory(state, address + 1, state->regs[H]);
 
@@ -731,8 +1022,7 @@ int SHLD(Cpu_state *state) {
     return 16;
 }
 
-int LHLD(Cpu_state *state) {
-    uint16_t address = get_immediate_address(state);
+static int LHLD(Cpu_state *state, uint16_t address) {
     state->regs[L] = read_memory(state, address);
     state->regs[H] = read_memory(state, address + 1);
 
@@ -743,82 +1033,82 @@ int LHLD(Cpu_state *state) {
 
 // -- Jump instructions --
 
-int PCHL(Cpu_state *state) {
+static int PCHL(Cpu_state *state) {
     state->pc = get_m_address(state, H, L) - 1;
     return 5;
 }
 
-int JMP(Cpu_state *state) {
-    state->pc = get_immediate_address(state) - 1;
+static int JMP(Cpu_state *state, uint16_t address) {
+    state->pc = address - 1;
     return 10;
 }
 
-int JC(Cpu_state *state) {
-    if (state->cc.cy)
-        JMP(state);
+static int JC(Cpu_state *state, uint16_t address) {
+    if (get_flags(state) & FLAG_CY)
+        JMP(state, address);
     else
         state->pc += 2;
 
     return 10;
 }
 
-int JNC(Cpu_state *state) {
-    if (!state->cc.cy)
-        JMP(state);
+static int JNC(Cpu_state *state, uint16_t address) {
+    if (!(get_flags(state) & FLAG_CY))
+        JMP(state, address);
     else
         state->pc += 2;
 
     return 10;
 }
 
-int JZ(Cpu_state *state) {
-    if (state->cc.z)
-        JMP(state);
+static int JZ(Cpu_state *state, uint16_t address) {
+    if (get_flags(state) & FLAG_Z)
+        JMP(state, address);
     else
         state->pc += 2;
 
     return 10;
 }
 
-int JNZ(Cpu_state *state) {
-    if (!state->cc.z)
-        JMP(state);
+static int JNZ(Cpu_state *state, uint16_t address) {
+    if (!(get_flags(state) & FLAG_Z))
+        JMP(state, address);
     else
         state->pc += 2;
 
     return 10;
 }
 
-int JM(Cpu_state *state) {
-    if (state->cc.s)
-        JMP(state);
+static int JM(Cpu_state *state, uint16_t address) {
+    if (get_flags(state) & FLAG_S)
+        JMP(state, address);
     else
         state->pc += 2;
 
     return 10;
 }
 
-int JP(Cpu_state *state) {
-    if (!state->cc.s)
-        JMP(state);
+static int JP(Cpu_state *state, uint16_t address) {
+    if (!(get_flags(state) & FLAG_S))
+        JMP(state, address);
     else
         state->pc += 2;
 
     return 10;
 }
 
-int JPE(Cpu_state *state) {
-    if (state->cc.p)
-        JMP(state);
+static int JPE(Cpu_state *state, uint16_t address) {
+    if (get_flags(state) & FLAG_P)
+        JMP(state, address);
     else
         state->pc += 2;
 
     return 10;
 }
 
-int JPO(Cpu_state *state) {
-    if (!state->cc.p)
-        JMP(state);
+static int JPO(Cpu_state *state, uint16_t address) {
+    if (!(get_flags(state) & FLAG_P))
+        JMP(state, address);
     else
         state->pc += 2;
 
@@ -827,101 +1117,105 @@ int JPO(Cpu_state *state) {
 
 // -- Call subroutine instructions --
 
-int CALL(Cpu_state *state) {
-#if CPUDIAG //Required to implement CP/M printing for CPUDIAG
-    if (5 == get_immediate_address(state)) {
-        if (state->regs[C] == 9) {
-            uint16_t offset = (state->regs[D]<<8) | (state->regs[E]);
-            uint8_t *str = &read_memory(state, offset+3);
+#if CPUDIAG
+// Just enough of the CP/M BDOS for test programs to report their results
+static void bdos_call(Cpu_state *state) {
+    uint16_t address = get_m_address(state, D, E);
+
+    switch (state->regs[C]) {
+    case 2: // console output
+        putchar(state->regs[E]);
+        break;
+    case 9: // print string
+        while (read_memory(state, address) != '$')
+            putchar(read_memory(state, address++));
+        break;
+    }
 
-            while (*str != '$')
-                printf("%c", *str++);
+    fflush(stdout);
+}
+#endif
 
-            printf("\n");
-        }
-        return 0;
-    }
-    else if (0 == get_immediate_address(state)) {
-        exit(0);
-    } else {
-        uint16_t return_addr = state->pc + 2;
-        write_memory(state, state->sp - 1, return_addr >> 8);
-        write_memory(state, state->sp - 2, return_addr & 0xff);
-        state->sp -= 2;
+static int CALL(Cpu_state *state, uint16_t address) {
+#if CPUDIAG // CP/M system calls, required by CPUDIAG and other CP/M programs
 
-        return JMP(state);
+    if (address == 5) {
+        bdos_call(state);
+        state->pc += 2;
+        return 17;
+    } else if (address == 0) {
+        exit(0); // warm boot, the program is done
     }
-#else
+#endif
     uint16_t return_addr = state->pc + 3;
     write_memory(state, state->sp - 1, return_addr >> 8);
     write_memory(state, state->sp - 2, return_addr & 0xff);
     state->sp -= 2;
 
-    JMP(state);
+    JMP(state, address);
 
     return 17;
-#endif
 }
 
-int CC(Cpu_state *state) {
-    if (state->cc.cy)
-        return CALL(state);
+static int CC(Cpu_state *state, uint16_t address) {
+    if (get_flags(state) & FLAG_CY)
+        return CALL(state, address);
 
     state->pc += 2;
     return 11;
 }
 
-int CNC(Cpu_state *state) {
-    if (!state->cc.cy)
-        return CALL(state);
+static int CNC(Cpu_state *state, uint16_t address) {
+    if (!(get_flags(state) & FLAG_CY))
+        return CALL(state, address);
 
     state->pc += 2;
     return 11;
 }
 
-int CZ(Cpu_state *state) {
-    if (state->cc.z)
-        return CALL(state);
+static int CZ(Cpu_state *state, uint16_t address) {
+    if (get_flags(state) & FLAG_Z)
+        return CALL(state, address);
 
     state->pc += 2;
     return 11;
 }
 
-int CNZ(Cpu_state *state) {
-    if (!state->cc.z)
-        return CALL(state);
+static int CNZ(Cpu_state *state, uint16_t address) {
+    if (!(get_flags(state) & FLAG_Z))
+        return CALL(state, address);
 
     state->pc += 2;
     return 11;
 }
 
-int CM(Cpu_state *state) {
-    if (state->cc.s)
-        return CALL(state);
+static int CM(Cpu_state *state, uint16_t address) {
+    if (get_flags(state) & FLAG_S)
+        return CALL(state, address);
 
     state->pc += 2;
     return 11;
 }
 
-int CP(Cpu_state *state) {
-    if (!state->cc.s)
-        return CALL(state);
+static int CP(Cpu_state *state, uint16_t address) {
+    if (!(get_flags(state) & FLAG_S))
+        return CALL(state, address);
 
     state->pc += 2;
     return 11;
 }
 
-int CPE(Cpu_state *state) {
-    if (state->cc.p)
-        return CALL(state);
+static int CPE(Cpu_state *state, uint16_t address) {
+    if (get_flags(state) & FLAG_P)
+        return CALL(state, address);
 
     state->pc += 2;
     return 11;
 }
 
-int CPO(Cpu_state *state) {
-    if (!state->cc.p)
-        return CALL(state);
+static int CPO(Cpu_state *state, uint16_t address) {
+    if (!(get_flags(state) & FLAG_P))
+        return CALL(state, address);
 
     state->pc += 2;
     return 11;
@@ -929,64 +1223,64 @@ int CPO(Cpu_state *state) {
 
 // -- Return from subroutine instructions --
 
-int RET(Cpu_state *state) {
+static int RET(Cpu_state *state) {
     state->pc = read_memory(state, state->sp) | (read_memory(state, state->sp+1) << 8);
     state->pc--;
     state->sp += 2;
     return 10;
 }
 
-int RC(Cpu_state *state) {
-    if (state->cc.cy)
+static int RC(Cpu_state *state) {
+    if (get_flags(state) & FLAG_CY)
         return RET(state) + 1;
 
     return 5;
 }
 
-int RNC(Cpu_state *state) {
-    if (!state->cc.cy)
+static int RNC(Cpu_state *state) {
+    if (!(get_flags(state) & FLAG_CY))
         return RET(state) + 1;
 
     return 5;
 }
 
-int RZ(Cpu_state *state) {
-    if (state->cc.z)
+static int RZ(Cpu_state *state) {
+    if (get_flags(state) & FLAG_Z)
         return RET(state) + 1;
 
     return 5;
 }
 
-int RNZ(Cpu_state *state) {
-    if (!state->cc.z)
+static int RNZ(Cpu_state *state) {
+    if (!(get_flags(state) & FLAG_Z))
         return RET(state) + 1;
 
     return 5;
 }
 
-int RM(Cpu_state *state) {
-    if (state->cc.s)
+static int RM(Cpu_state *state) {
+    if (get_flags(state) & FLAG_S)
         return RET(state) + 1;
 
     return 5;
 }
 
-int RP(Cpu_state *state) {
-    if (!state->cc.s)
+static int RP(Cpu_state *state) {
+    if (!(get_flags(state) & FLAG_S))
         return RET(state) + 1;
 
     return 5;
 }
 
-int RPE(Cpu_state *state) {
-    if (state->cc.p)
+static int RPE(Cpu_state *state) {
+    if (get_flags(state) & FLAG_P)
         return RET(state) + 1;
 
     return 5;
 }
 
-int RPO(Cpu_state *state) {
-    if (!state->cc.p)
+static int RPO(Cpu_state *state) {
+    if (!(get_flags(state) & FLAG_P))
         return RET(state) + 1;
 
     return 5;
@@ -994,27 +1288,31 @@ int RPO(Cpu_state *state) {
 
 // -- RST --
 
-int RST(Cpu_state *state, uint16_t offset) {
-    uint16_t return_addr = state->pc + 3;
+// Pushes the return address and jumps to the restart vector
+static void restart(Cpu_state *state, uint16_t return_addr, uint16_t offset) {
     write_memory(state, state->sp - 1, return_addr >> 8);
     write_memory(state, state->sp - 2, return_addr & 0xff);
     state->sp -= 2;
 
     state->pc = offset << 3;
-    //decrement pc?
+}
+
+static int RST(Cpu_state *state, uint16_t offset) {
+    restart(state, state->pc + 1, offset);
+    state->pc--; // stepped onto the vector after the op
 
     return 11;
 }
 
 // -- Interrupt flip-flop instructions --
 
-int EI(Cpu_state *state) {
+static int EI(Cpu_state *state) {
     state->int_enable = 1;
 
     return 4;
 }
 
-int DI(Cpu_state *state) {
+static int DI(Cpu_state *state) {
     state->int_enable = 0;
 
     return 4;
@@ -1022,21 +1320,49 @@ int DI(Cpu_state *state) {
 
 // -- Input/output instructions --
 
-int IN(Cpu_state *state) {
-    //TODO
+void clear_ports(Cpu_state *state) {
+    for (int port = 0; port < PORT_COUNT; port++) {
+        state->ports.in[port] = NULL;
+        state->ports.out[port] = NULL;
+        state->ports.in_context[port] = NULL;
+        state->ports.out_context[port] = NULL;
+    }
+}
+
+void map_port_in(Cpu_state *state, uint8_t port, Port_in handler, void *context) {
+    state->ports.in[port] = handler;
+    state->ports.in_context[port] = context;
+}
+
+void map_port_out(Cpu_state *state, uint8_t port, Port_out handler,
+        void *context) {
+    state->ports.out[port] = handler;
+    state->ports.out_context[port] = context;
+}
+
+static int IN(Cpu_state *state, uint8_t data) {
+    Port_in handler = state->ports.in[data];
+
+    if (handler)
+        state->regs[A] = handler(state->ports.in_context[data], data);
+
     state->pc++;
     return 10;
 }
 
-int OUT(Cpu_state *state) {
-    //TODO
+static int OUT(Cpu_state *state, uint8_t data) {
+    Port_out handler = state->ports.out[data];
+
+    if (handler)
+        handler(state->ports.out_context[data], data, state->regs[A]);
+
     state->pc++;
     return 10;
 }
 
 // -- HLT --
 
-int HLT(Cpu_state *state) {
+static int HLT(Cpu_state *state) {
     if (state->int_enable) {
         //TODO
     }
@@ -1044,325 +1370,522 @@ int HLT(Cpu_state *state) {
     return 7;
 }
 
+// -- Misc instructions --
+
+static int NOP(Cpu_state *state) {
+    (void)state;
+    return 4;
+}
+
+static int UNDOCUMENTED(Cpu_state *state) {
+    (void)state;
+    exit(1); // undocumented instruction!!
+}
+
+// -- Opcode table --
+//
+// Each opcode is listed exactly once here, with its length in bytes, the
+// dispatch engines below are all generated from this list. Handlers taking
+// immediate data get it decoded as operand.
+
+#define OPCODES(X) \
+    X(0x00, 1, NOP(state))              \
+    X(0x01, 3, LXI(state, B, operand))  \
+    X(0x02, 1, STAX(state, B))          \
+    X(0x03, 1, INX(state, B))           \
+    X(0x04, 1, INR(state, B))           \
+    X(0x05, 1, DCR(state, B))           \
+    X(0x06, 2, MVI(state, B, operand))  \
+    X(0x07, 1, RLC(state))              \
+                                        \
+    X(0x08, 1, UNDOCUMENTED(state))     \
+    X(0x09, 1, DAD(state, B))           \
+    X(0x0a, 1, LDAX(state, B))          \
+    X(0x0b, 1, DCX(state, B))           \
+    X(0x0c, 1, INR(state, C))           \
+    X(0x0d, 1, DCR(state, C))           \
+    X(0x0e, 2, MVI(state, C, operand))  \
+    X(0x0f, 1, RRC(state))              \
+                                        \
+    X(0x10, 1, UNDOCUMENTED(state))     \
+    X(0x11, 3, LXI(state, D, operand))  \
+    X(0x12, 1, STAX(state, D))          \
+    X(0x13, 1, INX(state, D))           \
+    X(0x14, 1, INR(state, D))           \
+    X(0x15, 1, DCR(state, D))           \
+    X(0x16, 2, MVI(state, D, operand))  \
+    X(0x17, 1, RAL(state))              \
+                                        \
+    X(0x18, 1, UNDOCUMENTED(state))     \
+    X(0x19, 1, DAD(state, D))           \
+    X(0x1a, 1, LDAX(state, D))          \
+    X(0x1b, 1, DCX(state, D))           \
+    X(0x1c, 1, INR(state, E))           \
+    X(0x1d, 1, DCR(state, E))           \
+    X(0x1e, 2, MVI(state, E, operand))  \
+    X(0x1f, 1, RAR(state))              \
+                                        \
+    X(0x20, 1, UNDOCUMENTED(state))     \
+    X(0x21, 3, LXI(state, H, operand))  \
+    X(0x22, 3, SHLD(state, operand))    \
+    X(0x23, 1, INX(state, H))           \
+    X(0x24, 1, INR(state, H))           \
+    X(0x25, 1, DCR(state, H))           \
+    X(0x26, 2, MVI(state, H, operand))  \
+    X(0x27, 1, DAA(state))              \
+                                        \
+    X(0x28, 1, UNDOCUMENTED(state))     \
+    X(0x29, 1, DAD(state, H))           \
+    X(0x2a, 3, LHLD(state, operand))    \
+    X(0x2b, 1, DCX(state, H))           \
+    X(0x2c, 1, INR(state, L))           \
+    X(0x2d, 1, DCR(state, L))           \
+    X(0x2e, 2, MVI(state, L, operand))  \
+    X(0x2f, 1, CMA(state))              \
+                                        \
+    X(0x30, 1, UNDOCUMENTED(state))     \
+    X(0x31, 3, LXI(state, SP, operand)) \
+    X(0x32, 3, STA(state, operand))     \
+    X(0x33, 1, INX(state, SP))          \
+    X(0x34, 1, INR(state, M))           \
+    X(0x35, 1, DCR(state, M))           \
+    X(0x36, 2, MVI(state, M, operand))  \
+    X(0x37, 1, STC(state))              \
+                                        \
+    X(0x38, 1, UNDOCUMENTED(state))     \
+    X(0x39, 1, DAD(state, SP))          \
+    X(0x3a, 3, LDA(state, operand))     \
+    X(0x3b, 1, DCX(state, SP))          \
+    X(0x3c, 1, INR(state, A))           \
+    X(0x3d, 1, DCR(state, A))           \
+    X(0x3e, 2, MVI(state, A, operand))  \
+    X(0x3f, 1, CMC(state))              \
+                                        \
+    X(0x40, 1, MOV(state, B, B))        \
+    X(0x41, 1, MOV(state, B, C))        \
+    X(0x42, 1, MOV(state, B, D))        \
+    X(0x43, 1, MOV(state, B, E))        \
+    X(0x44, 1, MOV(state, B, H))        \
+    X(0x45, 1, MOV(state, B, L))        \
+    X(0x46, 1, MOV(state, B, M))        \
+    X(0x47, 1, MOV(state, B, A))        \
+                                        \
+    X(0x48, 1, MOV(state, C, B))        \
+    X(0x49, 1, MOV(state, C, C))        \
+    X(0x4a, 1, MOV(state, C, D))        \
+    X(0x4b, 1, MOV(state, C, E))        \
+    X(0x4c, 1, MOV(state, C, H))        \
+    X(0x4d, 1, MOV(state, C, L))        \
+    X(0x4e, 1, MOV(state, C, M))        \
+    X(0x4f, 1, MOV(state, C, A))        \
+                                        \
+    X(0x50, 1, MOV(state, D, B))        \
+    X(0x51, 1, MOV(state, D, C))        \
+    X(0x52, 1, MOV(state, D, D))        \
+    X(0x53, 1, MOV(state, D, E))        \
+    X(0x54, 1, MOV(state, D, H))        \
+    X(0x55, 1, MOV(state, D, L))        \
+    X(0x56, 1, MOV(state, D, M))        \
+    X(0x57, 1, MOV(state, D, A))        \
+                                        \
+    X(0x58, 1, MOV(state, E, B))        \
+    X(0x59, 1, MOV(state, E, C))        \
+    X(0x5a, 1, MOV(state, E, D))        \
+    X(0x5b, 1, MOV(state, E, E))        \
+    X(0x5c, 1, MOV(state, E, H))        \
+    X(0x5d, 1, MOV(state, E, L))        \
+    X(0x5e, 1, MOV(state, E, M))        \
+    X(0x5f, 1, MOV(state, E, A))        \
+                                        \
+    X(0x60, 1, MOV(state, H, B))        \
+    X(0x61, 1, MOV(state, H, C))        \
+    X(0x62, 1, MOV(state, H, D))        \
+    X(0x63, 1, MOV(state, H, E))        \
+    X(0x64, 1, MOV(state, H, H))        \
+    X(0x65, 1, MOV(state, H, L))        \
+    X(0x66, 1, MOV(state, H, M))        \
+    X(0x67, 1, MOV(state, H, A))        \
+                                        \
+    X(0x68, 1, MOV(state, L, B))        \
+    X(0x69, 1, MOV(state, L, C))        \
+    X(0x6a, 1, MOV(state, L, D))        \
+    X(0x6b, 1, MOV(state, L, E))        \
+    X(0x6c, 1, MOV(state, L, H))        \
+    X(0x6d, 1, MOV(state, L, L))        \
+    X(0x6e, 1, MOV(state, L, M))        \
+    X(0x6f, 1, MOV(state, L, A))        \
+                                        \
+    X(0x70, 1, MOV(state, M, B))        \
+    X(0x71, 1, MOV(state, M, C))        \
+    X(0x72, 1, MOV(state, M, D))        \
+    X(0x73, 1, MOV(state, M, E))        \
+    X(0x74, 1, MOV(state, M, H))        \
+    X(0x75, 1, MOV(state, M, L))        \
+    X(0x76, 1, HLT(state))              \
+    X(0x77, 1, MOV(state, M, A))        \
+                                        \
+    X(0x78, 1, MOV(state, A, B))        \
+    X(0x79, 1, MOV(state, A, C))        \
+    X(0x7a, 1, MOV(state, A, D))        \
+    X(0x7b, 1, MOV(state, A, E))        \
+    X(0x7c, 1, MOV(state, A, H))        \
+    X(0x7d, 1, MOV(state, A, L))        \
+    X(0x7e, 1, MOV(state, A, M))        \
+    X(0x7f, 1, MOV(state, A, A))        \
+                                        \
+    X(0x80, 1, ADD(state, B))           \
+    X(0x81, 1, ADD(state, C))           \
+    X(0x82, 1, ADD(state, D))           \
+    X(0x83, 1, ADD(state, E))           \
+    X(0x84, 1, ADD(state, H))           \
+    X(0x85, 1, ADD(state, L))           \
+    X(0x86, 1, ADD(state, M))           \
+    X(0x87, 1, ADD(state, A))           \
+                                        \
+    X(0x88, 1, ADC(state, B))           \
+    X(0x89, 1, ADC(state, C))           \
+    X(0x8a, 1, ADC(state, D))           \
+    X(0x8b, 1, ADC(state, E))           \
+    X(0x8c, 1, ADC(state, H))           \
+    X(0x8d, 1, ADC(state, L))           \
+    X(0x8e, 1, ADC(state, M))           \
+    X(0x8f, 1, ADC(state, A))           \
+                                        \
+    X(0x90, 1, SUB(state, B))           \
+    X(0x91, 1, SUB(state, C))           \
+    X(0x92, 1, SUB(state, D))           \
+    X(0x93, 1, SUB(state, E))           \
+    X(0x94, 1, SUB(state, H))           \
+    X(0x95, 1, SUB(state, L))           \
+    X(0x96, 1, SUB(state, M))           \
+    X(0x97, 1, SUB(state, A))           \
+                                        \
+    X(0x98, 1, SBB(state, B))           \
+    X(0x99, 1, SBB(state, C))           \
+    X(0x9a, 1, SBB(state, D))           \
+    X(0x9b, 1, SBB(state, E))           \
+    X(0x9c, 1, SBB(state, H))           \
+    X(0x9d, 1, SBB(state, L))           \
+    X(0x9e, 1, SBB(state, M))           \
+    X(0x9f, 1, SBB(state, A))           \
+                                        \
+    X(0xa0, 1, ANA(state, B))           \
+    X(0xa1, 1, ANA(state, C))           \
+    X(0xa2, 1, ANA(state, D))           \
+    X(0xa3, 1, ANA(state, E))           \
+    X(0xa4, 1, ANA(state, H))           \
+    X(0xa5, 1, ANA(state, L))           \
+    X(0xa6, 1, ANA(state, M))           \
+    X(0xa7, 1, ANA(state, A))           \
+                                        \
+    X(0xa8, 1, XRA(state, B))           \
+    X(0xa9, 1, XRA(state, C))           \
+    X(0xaa, 1, XRA(state, D))           \
+    X(0xab, 1, XRA(state, E))           \
+    X(0xac, 1, XRA(state, H))           \
+    X(0xad, 1, XRA(state, L))           \
+    X(0xae, 1, XRA(state, M))           \
+    X(0xaf, 1, XRA(state, A))           \
+                                        \
+    X(0xb0, 1, ORA(state, B))           \
+    X(0xb1, 1, ORA(state, C))           \
+    X(0xb2, 1, ORA(state, D))           \
+    X(0xb3, 1, ORA(state, E))           \
+    X(0xb4, 1, ORA(state, H))           \
+    X(0xb5, 1, ORA(state, L))           \
+    X(0xb6, 1, ORA(state, M))           \
+    X(0xb7, 1, ORA(state, A))           \
+                                        \
+    X(0xb8, 1, CMP(state, B))           \
+    X(0xb9, 1, CMP(state, C))           \
+    X(0xba, 1, CMP(state, D))           \
+    X(0xbb, 1, CMP(state, E))           \
+    X(0xbc, 1, CMP(state, H))           \
+    X(0xbd, 1, CMP(state, L))           \
+    X(0xbe, 1, CMP(state, M))           \
+    X(0xbf, 1, CMP(state, A))           \
+                                        \
+    X(0xc0, 1, RNZ(state))              \
+    X(0xc1, 1, POP(state, B))           \
+    X(0xc2, 3, JNZ(state, operand))     \
+    X(0xc3, 3, JMP(state, operand))     \
+    X(0xc4, 3, CNZ(state, operand))     \
+    X(0xc5, 1, PUSH(state, B))          \
+    X(0xc6, 2, ADI(state, operand))     \
+    X(0xc7, 1, RST(state, 0))           \
+                                        \
+    X(0xc8, 1, RZ(state))               \
+    X(0xc9, 1, RET(state))              \
+    X(0xca, 3, JZ(state, operand))      \
+    X(0xcb, 1, UNDOCUMENTED(state))     \
+    X(0xcc, 3, CZ(state, operand))      \
+    X(0xcd, 3, CALL(state, operand))    \
+    X(0xce, 2, ACI(state, operand))     \
+    X(0xcf, 1, RST(state, 1))           \
+                                        \
+    X(0xd0, 1, RNC(state))              \
+    X(0xd1, 1, POP(state, D))           \
+    X(0xd2, 3, JNC(state, operand))     \
+    X(0xd3, 2, OUT(state, operand))     \
+    X(0xd4, 3, CNC(state, operand))     \
+    X(0xd5, 1, PUSH(state, D))          \
+    X(0xd6, 2, SUI(state, operand))     \
+    X(0xd7, 1, RST(state, 2))           \
+                                        \
+    X(0xd8, 1, RC(state))               \
+    X(0xd9, 1, UNDOCUMENTED(state))     \
+    X(0xda, 3, JC(state, operand))      \
+    X(0xdb, 2, IN(state, operand))      \
+    X(0xdc, 3, CC(state, operand))      \
+    X(0xdd, 1, UNDOCUMENTED(state))     \
+    X(0xde, 2, SBI(state, operand))     \
+    X(0xdf, 1, RST(state, 3))           \
+                                        \
+    X(0xe0, 1, RPO(state))              \
+    X(0xe1, 1, POP(state, H))           \
+    X(0xe2, 3, JPO(state, operand))     \
+    X(0xe3, 1, XTHL(state))             \
+    X(0xe4, 3, CPO(state, operand))     \
+    X(0xe5, 1, PUSH(state, H))          \
+    X(0xe6, 2, ANI(state, operand))     \
+    X(0xe7, 1, RST(state, 4))           \
+                                        \
+    X(0xe8, 1, RPE(state))              \
+    X(0xe9, 1, PCHL(state))             \
+    X(0xea, 3, JPE(state, operand))     \
+    X(0xeb, 1, XCHG(state))             \
+    X(0xec, 3, CPE(state, operand))     \
+    X(0xed, 1, UNDOCUMENTED(state))     \
+    X(0xee, 2, XRI(state, operand))     \
+    X(0xef, 1, RST(state, 5))           \
+                                        \
+    X(0xf0, 1, RP(state))               \
+    X(0xf1, 1, POP(state, PSW))         \
+    X(0xf2, 3, JP(state, operand))      \
+    X(0xf3, 1, DI(state))               \
+    X(0xf4, 3, CP(state, operand))      \
+    X(0xf5, 1, PUSH(state, PSW))        \
+    X(0xf6, 2, ORI(state, operand))     \
+    X(0xf7, 1, RST(state, 6))           \
+                                        \
+    X(0xf8, 1, RM(state))               \
+    X(0xf9, 1, SPHL(state))             \
+    X(0xfa, 3, JM(state, operand))      \
+    X(0xfb, 1, EI(state))               \
+    X(0xfc, 3, CM(state, operand))      \
+    X(0xfd, 1, UNDOCUMENTED(state))     \
+    X(0xfe, 2, CPI(state, operand))     \
+    X(0xff, 1, RST(state, 7))
+
 // -- The emulation nation --
 
-int emulate_op(Cpu_state *state) {
-    uint8_t op_code = read_memory(state, state->pc);
+#if DISPATCH == DISPATCH_THREADED && !defined(__GNUC__)
+#undef DISPATCH
+#define DISPATCH DISPATCH_TABLE // computed goto is a GNU extension
+#endif
 
-    int cyc = 0;
+#define HANDLER(op_code, length, call) \
+    static int op_##op_code(Cpu_state *state, uint16_t operand) { \
+        (void)operand; \
+        return call; \
+    }
+#define TABLE_ENTRY(op_code, length, call) [op_code] = op_##op_code,
+#define LENGTH_ENTRY(op_code, length, call) [op_code] = length,
+
+OPCODES(HANDLER)
+
+// Also used by the translator in jit.c
+const Op_handler op_table[0x100] = {
+    OPCODES(TABLE_ENTRY)
+};
+
+const uint8_t op_length[0x100] = {
+    OPCODES(LENGTH_ENTRY)
+};
+
+// Immediate data of the instruction at pc
+uint16_t fetch_operand(Cpu_state *state, uint16_t pc, int length) {
+    switch (length) {
+    case 2:
+        return read_memory(state, pc + 1);
+    case 3:
+        return (read_memory(state, pc + 2) << 8) | read_memory(state, pc + 1);
+    }
+
+    return 0;
+}
+
+#if DECODE_CACHE
+static Decoded decode_slow(Cpu_state *state) {
+    uint16_t pc = state->pc;
+    int page = pc >> PAGE_SHIFT;
+    Decoded decoded;
+
+    decoded.op_code = read_memory(state, pc);
+    decoded.length = op_length[decoded.op_code];
+    decoded.handler = op_table[decoded.op_code];
+    decoded.operand = fetch_operand(state, pc, decoded.length);
+
+    // Only instructions wholly inside one host memory page can be cached, the
+    // page's code watch wouldn't cover the rest
+    if (state->map.read[page] && !state->map.shared_decoded[page]
+            && (pc + decoded.length - 1) >> PAGE_SHIFT == page) {
+        if (!state->map.decoded[page])
+            state->map.decoded[page] = calloc(PAGE_SIZE, sizeof(Decoded));
+
+        watch_code_page(state, page);
+        state->map.decoded[page][pc & PAGE_MASK] = decoded;
+    }
+
+    return decoded;
+}
+
+static inline Decoded decode(Cpu_state *state) {
+    Decoded *page = state->map.decoded[state->pc >> PAGE_SHIFT];
+
+    if (page && page[state->pc & PAGE_MASK].length)
+        return page[state->pc & PAGE_MASK];
 
-#if DISASSEMBLE_IN_EMULATION
-    disassemble_op(state->memory, state->pc);
+    return decode_slow(state);
+}
+
+// The operand comes out of the cache along with the opcode
+#define FETCH(op_code, operand) { \
+    Decoded decoded = decode(state); \
+    op_code = decoded.op_code; \
+    operand = decoded.operand; \
+}
+#define FETCH_OPERAND(operand, length)
+#else
+#define FETCH(op_code, operand) op_code = read_memory(state, state->pc);
+#define FETCH_OPERAND(operand, length) \
+    operand = fetch_operand(state, state->pc, length);
 #endif
 
+static inline void trace_op(Cpu_state *state, uint8_t op_code) {
+    (void)state;
+    (void)op_code;
+#if TRACE
+    if (state->trace)
+        trace_record(state, op_code);
+#endif
+}
+
+static inline void trace_cycles(Cpu_state *state, int cyc) {
+    (void)state;
+    (void)cyc;
+#if TRACE
+    if (state->trace)
+        state->trace->cycles += cyc;
+#endif
+}
+
+#if DISPATCH == DISPATCH_THREADED
+#define LABEL_ADDRESS(op_code, length, call) [op_code] = &&label_##op_code,
+#endif
+
+static inline int step(Cpu_state *state) {
+    uint8_t op_code;
+    uint16_t operand = 0;
+
+#if PROFILE
+    uint16_t pc = state->pc;
+    bool sampled = state->profile && profile_sample(state->profile);
+    double start = sampled ? profile_clock() : 0;
+#endif
+
+    FETCH(op_code, operand)
+
+    int cyc = 0;
+
+    trace_op(state, op_code);
+
+#if DISPATCH == DISPATCH_THREADED
+#define LABEL(op_code, length, call) \
+    label_##op_code: FETCH_OPERAND(operand, length) cyc = call; goto done;
+
+    static void *const labels[0x100] = {
+        OPCODES(LABEL_ADDRESS)
+    };
+
+    goto *labels[op_code];
+    OPCODES(LABEL)
+done:
+#elif DISPATCH == DISPATCH_TABLE
+    FETCH_OPERAND(operand, op_length[op_code])
+    cyc = op_table[op_code](state, operand);
+#else
+#define SWITCH_CASE(op_code, length, call) \
+    case op_code: FETCH_OPERAND(operand, length) cyc = call; break;
+
     switch (op_code) {
-    case 0x00: cyc = 4;                     break; // NOP
-    case 0x01: cyc = LXI(state, B);         break;
-    case 0x02: cyc = STAX(state, B);        break;
-    case 0x03: cyc = INX(state, B);         break;
-    case 0x04: cyc = INR(state, B);         break;
-    case 0x05: cyc = DCR(state, B);         break;
-    case 0x06: cyc = MVI(state, B);         break;
-    case 0x07: cyc = RLC(state);            break;
-
-    case 0x08: exit(1); // undocumented instruction!! break;
-    case 0x09: cyc = DAD(state, B);         break;
-    case 0x0a: cyc = LDAX(state, B);        break;
-    case 0x0b: cyc = DCX(state, B);         break;
-    case 0x0c: cyc = INR(state, C);         break;
-    case 0x0d: cyc = DCR(state, C);         break;
-    case 0x0e: cyc = MVI(state, C);         break;
-    case 0x0f: cyc = RRC(state);            break;
-
-    case 0x10: exit(1); // undocumented instruction!! break;
-    case 0x11: cyc = LXI(state, D);         break;
-    case 0x12: cyc = STAX(state, D);        break;
-    case 0x13: cyc = INX(state, D);         break;
-    case 0x14: cyc = INR(state, D);         break;
-    case 0x15: cyc = DCR(state, D);         break;
-    case 0x16: cyc = MVI(state, D);         break;
-    case 0x17: cyc = RAL(state);            break;
-
-    case 0x18: exit(1); // undocumented instruction!! break;
-    case 0x19: cyc = DAD(state, D);         break;
-    case 0x1a: cyc = LDAX(state, D);        break;
-    case 0x1b: cyc = DCX(state, D);         break;
-    case 0x1c: cyc = INR(state, E);         break;
-    case 0x1d: cyc = DCR(state, E);         break;
-    case 0x1e: cyc = MVI(state, E);         break;
-    case 0x1f: cyc = RAR(state);            break;
-
-    case 0x20: exit(1); // undocumented instruction!! break;
-    case 0x21: cyc = LXI(state, H);         break;
-    case 0x22: cyc = SHLD(state);           break;
-    case 0x23: cyc = INX(state, H);         break;
-    case 0x24: cyc = INR(state, H);         break;
-    case 0x25: cyc = DCR(state, H);         break;
-    case 0x26: cyc = MVI(state, H);         break;
-    case 0x27: cyc = DAA(state);            break;
-
-    case 0x28: exit(1); // undocumented instruction!! break;
-    case 0x29: cyc = DAD(state, H);         break;
-    case 0x2a: cyc = LHLD(state);           break;
-    case 0x2b: cyc = DCX(state, H);         break;
-    case 0x2c: cyc = INR(state, L);         break;
-    case 0x2d: cyc = DCR(state, L);         break;
-    case 0x2e: cyc = MVI(state, L);         break;
-    case 0x2f: cyc = CMA(state);            break;
-
-    case 0x30: exit(1); // undocumented instruction!! break;
-    case 0x31: cyc = LXI(state, SP);        break;
-    case 0x32: cyc = STA(state);            break;
-    case 0x33: cyc = INX(state, SP);        break;
-    case 0x34: cyc = INR(state, M);         break;
-    case 0x35: cyc = DCR(state, M);         break;
-    case 0x36: cyc = MVI(state, M);         break;
-    case 0x37: cyc = STC(state);            break;
-
-    case 0x38: exit(1); // undocumented instruction!! break;
-    case 0x39: cyc = DAD(state, SP);        break;
-    case 0x3a: cyc = LDA(state);            break;
-    case 0x3b: cyc = DCX(state, SP);        break;
-    case 0x3c: cyc = INR(state, A);         break;
-    case 0x3d: cyc = DCR(state, A);         break;
-    case 0x3e: cyc = MVI(state, A);         break;
-    case 0x3f: cyc = CMC(state);            break;
-
-    case 0x40: cyc = MOV(state, B, B);      break;
-    case 0x41: cyc = MOV(state, B, C);      break;
-    case 0x42: cyc = MOV(state, B, D);      break;
-    case 0x43: cyc = MOV(state, B, E);      break;
-    case 0x44: cyc = MOV(state, B, H);      break;
-    case 0x45: cyc = MOV(state, B, L);      break;
-    case 0x46: cyc = MOV(state, B, M);      break;
-    case 0x47: cyc = MOV(state, B, A);      break;
-
-    case 0x48: cyc = MOV(state, C, B);      break;
-    case 0x49: cyc = MOV(state, C, C);      break;
-    case 0x4a: cyc = MOV(state, C, D);      break;
-    case 0x4b: cyc = MOV(state, C, E);      break;
-    case 0x4c: cyc = MOV(state, C, H);      break;
-    case 0x4d: cyc = MOV(state, C, L);      break;
-    case 0x4e: cyc = MOV(state, C, M);      break;
-    case 0x4f: cyc = MOV(state, C, A);      break;
-
-    case 0x50: cyc = MOV(state, D, B);      break;
-    case 0x51: cyc = MOV(state, D, C);      break;
-    case 0x52: cyc = MOV(state, D, D);      break;
-    case 0x53: cyc = MOV(state, D, E);      break;
-    case 0x54: cyc = MOV(state, D, H);      break;
-    case 0x55: cyc = MOV(state, D, L);      break;
-    case 0x56: cyc = MOV(state, D, M);      break;
-    case 0x57: cyc = MOV(state, D, A);      break;
-
-    case 0x58: cyc = MOV(state, E, B);      break;
-    case 0x59: cyc = MOV(state, E, C);      break;
-    case 0x5a: cyc = MOV(state, E, D);      break;
-    case 0x5b: cyc = MOV(state, E, E);      break;
-    case 0x5c: cyc = MOV(state, E, H);      break;
-    case 0x5d: cyc = MOV(state, E, L);      break;
-    case 0x5e: cyc = MOV(state, E, M);      break;
-    case 0x5f: cyc = MOV(state, E, A);      break;
-
-    case 0x60: cyc = MOV(state, H, B);      break;
-    case 0x61: cyc = MOV(state, H, C);      break;
-    case 0x62: cyc = MOV(state, H, D);      break;
-    case 0x63: cyc = MOV(state, H, E);      break;
-    case 0x64: cyc = MOV(state, H, H);      break;
-    case 0x65: cyc = MOV(state, H, L);      break;
-    case 0x66: cyc = MOV(state, H, M);      break;
-    case 0x67: cyc = MOV(state, H, A);      break;
-
-    case 0x68: cyc = MOV(state, L, B);      break;
-    case 0x69: cyc = MOV(state, L, C);      break;
-    case 0x6a: cyc = MOV(state, L, D);      break;
-    case 0x6b: cyc = MOV(state, L, E);      break;
-    case 0x6c: cyc = MOV(state, L, H);      break;
-    case 0x6d: cyc = MOV(state, L, L);      break;
-    case 0x6e: cyc = MOV(state, L, M);      break;
-    case 0x6f: cyc = MOV(state, L, A);      break;
-
-    case 0x70: cyc = MOV(state, M, B);      break;
-    case 0x71: cyc = MOV(state, M, C);      break;
-    case 0x72: cyc = MOV(state, M, D);      break;
-    case 0x73: cyc = MOV(state, M, E);      break;
-    case 0x74: cyc = MOV(state, M, H);      break;
-    case 0x75: cyc = MOV(state, M, L);      break;
-    case 0x76: cyc = HLT(state);            break;
-    case 0x77: cyc = MOV(state, M, A);      break;
-
-    case 0x78: cyc = MOV(state, A, B);      break;
-    case 0x79: cyc = MOV(state, A, C);      break;
-    case 0x7a: cyc = MOV(state, A, D);      break;
-    case 0x7b: cyc = MOV(state, A, E);      break;
-    case 0x7c: cyc = MOV(state, A, H);      break;
-    case 0x7d: cyc = MOV(state, A, L);      break;
-    case 0x7e: cyc = MOV(state, A, M);      break;
-    case 0x7f: cyc = MOV(state, A, A);      break;
-
-    case 0x80: cyc = ADD(state, B);         break;
-    case 0x81: cyc = ADD(state, C);         break;
-    case 0x82: cyc = ADD(state, D);         break;
-    case 0x83: cyc = ADD(state, E);         break;
-    case 0x84: cyc = ADD(state, H);         break;
-    case 0x85: cyc = ADD(state, L);         break;
-    case 0x86: cyc = ADD(state, M);         break;
-    case 0x87: cyc = ADD(state, A);         break;
-
-    case 0x88: cyc = ADC(state, B);         break;
-    case 0x89: cyc = ADC(state, C);         break;
-    case 0x8a: cyc = ADC(state, D);         break;
-    case 0x8b: cyc = ADC(state, E);         break;
-    case 0x8c: cyc = ADC(state, H);         break;
-    case 0x8d: cyc = ADC(state, L);         break;
-    case 0x8e: cyc = ADC(state, M);         break;
-    case 0x8f: cyc = ADC(state, A);         break;
-
-    case 0x90: cyc = SUB(state, B);         break;
-    case 0x91: cyc = SUB(state, C);         break;
-    case 0x92: cyc = SUB(state, D);         break;
-    case 0x93: cyc = SUB(state, E);         break;
-    case 0x94: cyc = SUB(state, H);         break;
-    case 0x95: cyc = SUB(state, L);         break;
-    case 0x96: cyc = SUB(state, M);         break;
-    case 0x97: cyc = SUB(state, A);         break;
-
-    case 0x98: cyc = SBB(state, B);         break;
-    case 0x99: cyc = SBB(state, C);         break;
-    case 0x9a: cyc = SBB(state, D);         break;
-    case 0x9b: cyc = SBB(state, E);         break;
-    case 0x9c: cyc = SBB(state, H);         break;
-    case 0x9d: cyc = SBB(state, L);         break;
-    case 0x9e: cyc = SBB(state, M);         break;
-    case 0x9f: cyc = SBB(state, A);         break;
-
-    case 0xa0: cyc = ANA(state, B);         break;
-    case 0xa1: cyc = ANA(state, C);         break;
-    case 0xa2: cyc = ANA(state, D);         break;
-    case 0xa3: cyc = ANA(state, E);         break;
-    case 0xa4: cyc = ANA(state, H);         break;
-    case 0xa5: cyc = ANA(state, L);         break;
-    case 0xa6: cyc = ANA(state, M);         break;
-    case 0xa7: cyc = ANA(state, A);         break;
-
-    case 0xa8: cyc = XRA(state, B);         break;
-    case 0xa9: cyc = XRA(state, C);         break;
-    case 0xaa: cyc = XRA(state, D);         break;
-    case 0xab: cyc = XRA(state, E);         break;
-    case 0xac: cyc = XRA(state, H);         break;
-    case 0xad: cyc = XRA(state, L);         break;
-    case 0xae: cyc = XRA(state, M);         break;
-    case 0xaf: cyc = XRA(state, A);         break;
-
-    case 0xb0: cyc = ORA(state, B);         break;
-    case 0xb1: cyc = ORA(state, C);         break;
-    case 0xb2: cyc = ORA(state, D);         break;
-    case 0xb3: cyc = ORA(state, E);         break;
-    case 0xb4: cyc = ORA(state, H);         break;
-    case 0xb5: cyc = ORA(state, L);         break;
-    case 0xb6: cyc = ORA(state, M);         break;
-    case 0xb7: cyc = ORA(state, A);         break;
-
-    case 0xb8: cyc = CMP(state, B);         break;
-    case 0xb9: cyc = CMP(state, C);         break;
-    case 0xba: cyc = CMP(state, D);         break;
-    case 0xbb: cyc = CMP(state, E);         break;
-    case 0xbc: cyc = CMP(state, H);         break;
-    case 0xbd: cyc = CMP(state, L);         break;
-    case 0xbe: cyc = CMP(state, M);         break;
-    case 0xbf: cyc = CMP(state, A);         break;
-
-    case 0xc0: cyc = RNZ(state);            break;
-    case 0xc1: cyc = POP(state, B);         break;
-    case 0xc2: cyc = JNZ(state);            break;
-    case 0xc3: cyc = JMP(state);            break;
-    case 0xc4: cyc = CNZ(state);            break;
-    case 0xc5: cyc = PUSH(state, B);        break;
-    case 0xc6: cyc = ADI(state);            break;
-    case 0xc7: cyc = RST(state, 0);         break;
-
-    case 0xc8: cyc = RZ(state);             break;
-    case 0xc9: cyc = RET(state);            break;
-    case 0xca: cyc = JZ(state);             break;
-    case 0xcb: exit(1);   // undocumented instruction!! break;
-    case 0xcc: cyc = CZ(state);             break;
-    case 0xcd: cyc = CALL(state);           break;
-    case 0xce: cyc = ACI(state);            break;
-    case 0xcf: cyc = RST(state, 1);         break;
-
-    case 0xd0: cyc = RNC(state);            break;
-    case 0xd1: cyc = POP(state, D);         break;
-    case 0xd2: cyc = JNC(state);            break;
-    case 0xd3: cyc = OUT(state);            break;
-    case 0xd4: cyc = CNC(state);            break;
-    case 0xd5: cyc = PUSH(state, D);        break;
-    case 0xd6: cyc = SUI(state);            break;
-    case 0xd7: cyc = RST(state, 2);         break;
-
-    case 0xd8: cyc = RC(state);             break;
-    case 0xd9: exit(1);   // undocumented instruction!! break;
-    case 0xda: cyc = JC(state);             break;
-    case 0xdb: cyc = IN(state);             break;
-    case 0xdc: cyc = CC(state);             break;
-    case 0xdd: exit(1);   // undocumented instruction!! break;
-    case 0xde: cyc = SBI(state);            break;
-    case 0xdf: cyc = RST(state, 3);         break;
-
-    case 0xe0: cyc = RPO(state);            break;
-    case 0xe1: cyc = POP(state, H);         break;
-    case 0xe2: cyc = JPO(state);            break;
-    case 0xe3: cyc = XTHL(state);           break;
-    case 0xe4: cyc = CPO(state);            break;
-    case 0xe5: cyc = PUSH(state, H);        break;
-    case 0xe6: cyc = ANI(state);            break;
-    case 0xe7: cyc = RST(state, 4);         break;
-
-    case 0xe8: cyc = RPE(state);            break;
-    case 0xe9: cyc = PCHL(state);           break;
-    case 0xea: cyc = JPE(state);            break;
-    case 0xeb: cyc = XCHG(state);           break;
-    case 0xec: cyc = CPE(state);            break;
-    case 0xed: exit(1);   // undocumented instruction!! break;
-    case 0xee: cyc = XRI(state);            break;
-    case 0xef: cyc = RST(state, 5);         break;
-
-    case 0xf0: cyc = RP(state);             break;
-    case 0xf1: cyc = POP(state, PSW);       break;
-    case 0xf2: cyc = JP(state);             break;
-    case 0xf3: cyc = DI(state);             break;
-    case 0xf4: cyc = CP(state);             break;
-    case 0xf5: cyc = PUSH(state, PSW);      break;
-    case 0xf6: cyc = ORI(state);            break;
-    case 0xf7: cyc = RST(state, 6);         break;
-
-    case 0xf8: cyc = RM(state);             break;
-    case 0xf9: cyc = SPHL(state);           break;
-    case 0xfa: cyc = JM(state);             break;
-    case 0xfb: cyc = EI(state);             break;
-    case 0xfc: cyc = CM(state);             break;
-    case 0xfd: exit(1);   // undocumented instruction!! break;
-    case 0xfe: cyc = CPI(state);            break;
-    case 0xff: cyc = RST(state, 7);         break;
+    OPCODES(SWITCH_CASE)
     }
-
-#if PRINT_STATE
-    printf("\tC=%d,P=%d,S=%d,Z=%d,AC=%d\n", state->cc.cy, state->cc.p,
-            state->cc.s, state->cc.z, state->cc.ac);
-    printf("\tA $%02x B $%02x C $%02x D $%02x E $%02x H $%02x L $%02x SP %04x\n",
-            state->regs[A], state->regs[B], state->regs[C], state->regs[D],
-            state->regs[E], state->regs[H], state->regs[L], state->sp);
 #endif
 
+    trace_cycles(state, cyc);
+
     state->pc++;
 
+#if PROFILE
+    if (state->profile)
+        profile_record(state->profile, pc, op_code, cyc,
+                sampled ? profile_clock() - start : -1);
+#endif
+
     return cyc;
 }
 
+int emulate_op(Cpu_state *state) {
+    return step(state);
+}
+
+// Runs until at least budget cycles have been spent, returns the overshoot
+int run_cycles(Cpu_state *state, int budget) {
+    int cyc = 0;
+
+#if DISPATCH == DISPATCH_THREADED && !PROFILE && !TRACE
+    uint8_t op_code;
+    uint16_t operand = 0;
+
+    // Each handler jumps straight to the next one, rather than back through a
+    // single shared dispatch point
+#define NEXT \
+    if (cyc >= budget) \
+        return cyc - budget; \
+    FETCH(op_code, operand) \
+    goto *labels[op_code];
+#define RUN_LABEL(op_code, length, call) \
+    label_##op_code: \
+    FETCH_OPERAND(operand, length) \
+    cyc += call; \
+    state->pc++; \
+    NEXT
+
+    static void *const labels[0x100] = {
+        OPCODES(LABEL_ADDRESS)
+    };
+
+    NEXT
+    OPCODES(RUN_LABEL)
+#else
+    while (cyc < budget)
+        cyc += step(state);
+
+    return cyc - budget;
+#endif
+}
+
+// Between instructions pc is already the next op, so that's the return
+// address and the vector is run from directly
 int interrupt(Cpu_state *state, uint16_t offset) {
     if (state->int_enable) {
-        state->pc -= 3;
+        trace_op(state, 0xc7 | (offset << 3)); // shows up as the RST
         state->int_enable = 0;
-        return RST(state, offset);
+
+        restart(state, state->pc, offset);
+        trace_cycles(state, 11);
+        return 11;
     }
 
     return 0;
@@ -1,10 +1,42 @@
+#ifndef CPU_H
+#define CPU_H
+
 #include<stdint.h>
 #include<stdbool.h>
 
 #define CPUDIAG 0
 
-#define DISASSEMBLE_IN_EMULATION 0
-#define PRINT_STATE 0
+// Run with a flat 64KB buffer and no memory map, as CP/M test programs expect.
+// Every access is an unchecked memory[address], a 16 bit address can't
+// overflow the buffer.
+#define FLAT_MEMORY CPUDIAG
+
+// Record every instruction's state into a ring buffer, written out at exit,
+// on a crash or on SIGUSR1, see trace.h. Runs everything through the
+// interpreter's single step.
+#define TRACE 0
+
+// Count the instructions run and the cycles spent per opcode and per address,
+// timing a sample of them on the host, and write a report at exit. Runs
+// everything through the interpreter's single step, see profile.h.
+#define PROFILE 0
+
+// Opcode dispatch engine used by emulate_op. The threaded engine relies on
+// computed goto, and falls back to the handler table on compilers without it.
+#define DISPATCH_SWITCH 0
+#define DISPATCH_TABLE 1
+#define DISPATCH_THREADED 2
+
+#define DISPATCH DISPATCH_THREADED
+
+// Compute the flags only when an instruction reads them, rather than after
+// every ALU operation. Code outside cpu.c goes through read/write_flags.
+#define LAZY_FLAGS 0
+
+// Keep every instruction executed from host memory decoded, keyed by its
+// address, so that it's fetched and decoded only once. RAM pages are dropped
+// from the cache when written to, see watch_code_page.
+#define DECODE_CACHE !FLAT_MEMORY
 
 // -- Register names --
 
@@ -21,29 +53,128 @@ enum Register {
     PSW,
 };
 
-// -- System state --
+// -- Flag bits, as laid out in the PSW --
+
+#define FLAG_CY 0x01
+#define FLAG_ONE 0x02 // always set
+#define FLAG_P 0x04
+#define FLAG_AC 0x10
+#define FLAG_Z 0x40
+#define FLAG_S 0x80
+#define FLAG_MASK (FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_CY)
+
+// -- Memory map --
+//
+// The address space is split into pages, each either backed directly by host
+// memory or serviced by a handler. Read-only pages have no write pointer.
+
+#define MEMORY_SIZE 0x10000 // size of the buffer in flat mode
+
+#define PAGE_SHIFT 8
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define PAGE_COUNT (0x10000 >> PAGE_SHIFT)
+
+struct Cpu_state;
+
+typedef uint8_t (*Read_handler)(struct Cpu_state *state, uint16_t address);
+typedef void (*Write_handler)(struct Cpu_state *state, uint16_t address, uint8_t value);
+
+// Executes an opcode but for pc++, given its immediate data if it has any
+typedef int (*Op_handler)(struct Cpu_state *state, uint16_t operand);
+
+typedef struct {
+    Op_handler handler;
+    uint16_t operand;
+    uint8_t op_code;
+    uint8_t length; // 0 if not decoded yet
+} Decoded;
 
 typedef struct {
-    bool z;
-    bool s;
-    bool p;
-    bool cy;
-    bool ac;
-    //bool pad;
-} Condition_codes;
+    uint8_t *read[PAGE_COUNT]; // NULL if serviced by the read handler
+    uint8_t *write[PAGE_COUNT]; // NULL if serviced by the write handler
+    Read_handler read_handler[PAGE_COUNT];
+    Write_handler write_handler[PAGE_COUNT];
+    uint8_t *trapped[PAGE_COUNT]; // write pointer of pages with a write trap
+    uint8_t traps[PAGE_COUNT]; // traps set on the page, see cpu.c
+    uint8_t dirty[PAGE_COUNT]; // a bit per tracker, see track_dirty_pages
+    Decoded *decoded[PAGE_COUNT]; // decode cache, allocated on first use
+    bool shared_decoded[PAGE_COUNT]; // decode cache owned elsewhere, see map_decoded
+} Memory_map;
+
+// -- IO ports --
+//
+// Each of the 256 ports has its own IN and OUT handler, so IN and OUT go
+// straight to the device on the port.
+
+#define PORT_COUNT 0x100
+
+typedef uint8_t (*Port_in)(void *context, uint8_t port);
+typedef void (*Port_out)(void *context, uint8_t port, uint8_t value);
 
 typedef struct {
+    Port_in in[PORT_COUNT]; // A is left untouched if NULL
+    Port_out out[PORT_COUNT]; // ignored if NULL
+    void *in_context[PORT_COUNT]; // passed to the handlers
+    void *out_context[PORT_COUNT];
+} Port_map;
+
+// -- System state --
+
+typedef struct Cpu_state {
     uint8_t regs[7]; // registers
     uint16_t sp; // stack pointer
     uint16_t pc; //program counter
-    uint8_t *memory;
-    Condition_codes cc;
+    uint8_t *memory; // backing buffer, accessed through map
+#if !FLAT_MEMORY
+    Memory_map map;
+#endif
+    uint8_t flags; // packed as in the PSW, see FLAG_*
+#if LAZY_FLAGS
+    uint8_t lazy_op; // flag computation still pending, see cpu.c
+    uint8_t lazy_a;
+    uint8_t lazy_b;
+    uint16_t lazy_res;
+#endif
     uint8_t int_enable;
+    Port_map ports;
+    void (*code_written)(struct Cpu_state *state, int page); // see watch_code_page
+    void *jit; // basic block translator, see jit.c
+    struct Profile *profile; // see PROFILE
+    struct Trace *trace; // see TRACE
 } Cpu_state;
 
 // -- Exported functions
 
+extern const uint8_t zsp_table[0x100];
+extern const Op_handler op_table[0x100];
+extern const uint8_t op_length[0x100];
+
 uint8_t read_memory(Cpu_state *state, uint16_t address);
 void write_memory(Cpu_state *state, uint16_t address, uint8_t value);
+#if !FLAT_MEMORY
+void clear_memory_map(Cpu_state *state);
+void free_memory_map(Cpu_state *state);
+void map_memory(Cpu_state *state, uint16_t address, uint32_t size,
+        uint8_t *memory, bool writable);
+void map_handlers(Cpu_state *state, uint16_t address, uint32_t size,
+        Read_handler read, Write_handler write);
+void watch_code_page(Cpu_state *state, int page);
+void track_dirty_pages(Cpu_state *state, uint16_t address, uint32_t size,
+        int tracker);
+void flush_code(Cpu_state *state, uint16_t address, uint32_t size);
+void decode_page(const uint8_t *memory, Decoded decoded[PAGE_SIZE]);
+void map_decoded(Cpu_state *state, int page, Decoded *decoded);
+#endif
+void clear_ports(Cpu_state *state);
+void map_port_in(Cpu_state *state, uint8_t port, Port_in handler, void *context);
+void map_port_out(Cpu_state *state, uint8_t port, Port_out handler,
+        void *context);
+uint16_t fetch_operand(Cpu_state *state, uint16_t pc, int length);
 int emulate_op(Cpu_state *state);
+int run_cycles(Cpu_state *state, int budget);
 int interrupt(Cpu_state *state, uint16_t offset);
+uint8_t read_flags(Cpu_state *state);
+void write_flags(Cpu_state *state, uint8_t flags);
+
+#endif
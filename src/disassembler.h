@@ -1,3 +1,5 @@
 #include<stdint.h>
+#include<stdio.h>
 
+int fdisassemble_op(FILE *out, uint8_t *codebuffer, int pc);
 int disassemble_op(uint8_t *codebuffer, int pc);
@@ -1,8 +1,35 @@
+#include <string.h>
 #include "display.h"
 #include <SDL2/SDL_render.h>
 
-void initialise_SDL(Display *display) {
-    int rendererFlags = SDL_RENDERER_ACCELERATED;
+// Packs a colour the way SDL_PIXELFORMAT_RGBA32 lays it out in memory
+static uint32_t rgba(uint8_t r, uint8_t g, uint8_t b) {
+    uint8_t bytes[4] = {r, g, b, 255};
+    uint32_t colour;
+
+    memcpy(&colour, bytes, sizeof(colour));
+    return colour;
+}
+
+// The cabinet's coloured cellophane strips, green over the bases and the
+// lives, red along the top
+static void initialise_overlay(Display *display) {
+    for (int x = 0; x < SCREEN_HEIGHT; x++) {
+        for (int y = 0; y < SCREEN_WIDTH; y++) {
+            if (x >= 184 && (x < 240 || (y >= 16 && y < 134)))
+                display->overlay[x][y] = rgba(0, 255, 0);
+            else if (x >= 32 && x < 64)
+                display->overlay[x][y] = rgba(255, 0, 0);
+            else
+                display->overlay[x][y] = rgba(255, 255, 255);
+        }
+    }
+}
+
+// With vsync, presentScene waits for the display's next refresh
+void initialise_SDL(Display *display, bool vsync) {
+    int rendererFlags = SDL_RENDERER_ACCELERATED
+        | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
     int windowFlags = SDL_WINDOW_RESIZABLE;
 
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
@@ -52,59 +79,58 @@ void initialise_SDL(Display *display) {
         printf("Failed to create texture: %s\n", SDL_GetError());
         exit(1);
     }
+
+    initialise_overlay(display);
+    display->drawn = false;
 }
 
-void prepareScene(Display *display, u_int8_t *memory) {
-    for (uint16_t i = 0; i < 0x1c00; i++) {
-        uint8_t byte = memory[i + 0x2400];
-
-        for(int bit = 0; bit < 8; bit++) {
-            int x = 255 - ((i * 8) % 256 + bit); //implicit rotation between
-            int y = i * 8 / 256; //buffer and texture
-
-            if (
-                    x >= SCREEN_HEIGHT ||
-                    y >= SCREEN_WIDTH ||
-                    x < 0 ||
-                    y < 0
-                    ) {
-                printf("Tried to draw outside pixel buffer");
-                exit(1);
-            }
-
-            uint8_t r = 0;
-            uint8_t g = 0;
-            uint8_t b = 0;
-
-            if ((byte >> bit) & 0x01) { //reverse bitshift??
-                if (x >= 184 && (x < 240 || (y >=16 && y < 134))) {
-                    g = 255;
-                } else if (x >= 32 && x < 64) {
-                    r = 255;
-                } else {
-                    r = 255;
-                    g = 255;
-                    b = 255;
-                }
-            }
-
-            display->pixels[x][y][0] = r;
-            display->pixels[x][y][1] = g;
-            display->pixels[x][y][2] = b;
-            display->pixels[x][y][3] = 255;//offload?
+// The video RAM is 1bpp and rotated: each 32 byte line is a column of the
+// screen, from the bottom up, with the lowest bit of each byte lowest. The
+// texture is filled a row at a time so that its writes are sequential, and
+// lit pixels take their colour from the overlay without branching.
+static void convert_columns(Display *display, u_int8_t *vram, int first,
+        int last) {
+    const uint32_t black = rgba(0, 0, 0);
+
+    for (int x = 0; x < SCREEN_HEIGHT; x++) {
+        const uint8_t *row = &vram[(SCREEN_HEIGHT - 1 - x) >> 3];
+        int bit = (SCREEN_HEIGHT - 1 - x) & 7;
+
+        for (int y = first; y < last; y++) {
+            uint32_t lit = -(uint32_t)((row[y * 32] >> bit) & 1);
+            display->pixels[x][y] = black | (display->overlay[x][y] & lit);
         }
     }
+}
 
-    SDL_UpdateTexture(
-            display->texture,
-            NULL,
-            &display->pixels,
-            sizeof(uint8_t) * 4 * SCREEN_WIDTH);
-
-    SDL_RenderClear(display->renderer);
-    SDL_RenderCopy(display->renderer, display->texture, NULL, NULL);
+// Converts and uploads only the bands of columns whose VRAM was written,
+// each run of dirty bands as one rectangle
+void prepareScene(Display *display, u_int8_t *vram, const bool dirty[BANDS]) {
+    for (int band = 0; band < BANDS; band++) {
+        if (display->drawn && !dirty[band])
+            continue;
+
+        int first = band;
+        while (band + 1 < BANDS && (!display->drawn || dirty[band + 1]))
+            band++;
+
+        SDL_Rect rect = {
+            first * BAND_WIDTH, 0, (band + 1 - first) * BAND_WIDTH, SCREEN_HEIGHT
+        };
+        convert_columns(display, vram, rect.x, rect.x + rect.w);
+        SDL_UpdateTexture(
+                display->texture,
+                &rect,
+                &display->pixels[0][rect.x],
+                sizeof(uint32_t) * SCREEN_WIDTH);
+    }
+    display->drawn = true;
 }
 
+// Copies the texture afresh every time, since the back buffer is undefined
+// after a present
 void presentScene(Display *display) {
+    SDL_RenderClear(display->renderer);
+    SDL_RenderCopy(display->renderer, display->texture, NULL, NULL);
     SDL_RenderPresent(display->renderer);
 }
@@ -1,15 +1,20 @@
+#include <stdbool.h>
 #include <SDL2/SDL.h>
 
 #define SCREEN_WIDTH  224
 #define SCREEN_HEIGHT 256
+#define BAND_WIDTH 8 // columns redrawn together, one 256 byte page of VRAM
+#define BANDS (SCREEN_WIDTH / BAND_WIDTH)
 
-typedef struct {
+typedef struct Display {
     SDL_Renderer *renderer;
     SDL_Window *window;
-    uint8_t pixels[SCREEN_HEIGHT][SCREEN_WIDTH][4];
+    uint32_t pixels[SCREEN_HEIGHT][SCREEN_WIDTH]; // RGBA32
+    uint32_t overlay[SCREEN_HEIGHT][SCREEN_WIDTH]; // colour of a lit pixel
     SDL_Texture *texture;
+    bool drawn; // whether the texture has been filled in at all
 } Display;
 
-void initialise_SDL(Display *display);
-void prepareScene(Display *display, u_int8_t *memory);
+void initialise_SDL(Display *display, bool vsync);
+void prepareScene(Display *display, u_int8_t *vram, const bool dirty[BANDS]);
 void presentScene(Display *display);
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "machine.h"
+#include "snapshot.h"
+#include "pacing.h"
+#include "rewind.h"
+
+// Runs the emulator without a window, audio or pacing, for batch and
+// regression runs. Nothing here may depend on SDL.
+
+#if !CPUDIAG
+static void usage(char *name) {
+    printf("Usage: %s [-f frames | -c cycles] [-H every] [-l file] [-s file]\n"
+            "       [-b frames] [-p mode] [rom directory]\n"
+            "  -f  run this many frames (default 600)\n"
+            "  -c  run whole frames until at least this many cycles\n"
+            "  -H  print a hash of the framebuffer every this many frames\n"
+            "  -l  start from the snapshot in file\n"
+            "  -s  save a snapshot to file at the end\n"
+            "  -b  keep a rewind buffer, and at the end go back this many frames\n"
+            "      and check that running them again ends up the same\n"
+            "  -p  realtime, uncapped (default) or a speed multiplier\n",
+            name);
+    exit(1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+int main(int argc, char **argv) {
+#if CPUDIAG
+    run_cpm_program(argc > 1 ? argv[1] : NULL);
+#else
+    long frames = 600;
+    long long cycles = 0; // run by cycles instead if set
+    long hash_every = 0;
+    char *load_path = NULL;
+    char *save_path = NULL;
+    long rewind_by = 0;
+    Pace_mode mode = PACE_UNCAPPED;
+    double multiplier = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:c:H:l:s:b:p:")) != -1) {
+        switch (opt) {
+        case 'f':
+            frames = atol(optarg);
+            break;
+        case 'c':
+            cycles = atoll(optarg);
+            break;
+        case 'H':
+            hash_every = atol(optarg);
+            break;
+        case 'l':
+            load_path = optarg;
+            break;
+        case 's':
+            save_path = optarg;
+            break;
+        case 'b':
+            rewind_by = atol(optarg);
+            break;
+        case 'p':
+            if (pacer_parse(optarg, &mode, &multiplier) != 0)
+                exit(1);
+            if (mode == PACE_VSYNC) {
+                printf("There's no display to sync to\n");
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind > 1)
+        usage(argv[0]);
+
+    Arcade_system system;
+    initialise_system(&system, optind < argc ? argv[optind] : "rom");
+
+    static Snapshot snapshot;
+    if (load_path) {
+        if (snapshot_load(&snapshot, load_path) != 0)
+            exit(1);
+        snapshot_restore(&system, &snapshot);
+    }
+
+    // Interrupts are raised at the same points as in the SDL frame loop, so
+    // a run here matches one there frame for frame
+    Rewind *rewind = rewind_by ? rewind_init(&system) : NULL;
+    double rewind_time = 0;
+
+    Pacer pacer;
+    pacer_init(&pacer, mode, multiplier);
+
+    long frame = 0;
+    long long total = 0;
+    double start = now();
+
+    while (cycles ? total < cycles : frame < frames) {
+        total += run_frame(&system);
+        frame++;
+
+        if (rewind) {
+            double push_start = now();
+            rewind_push(rewind, &system);
+            rewind_time += now() - push_start;
+        }
+
+        if (hash_every && frame % hash_every == 0)
+            printf("frame %ld %016llx\n", frame,
+                    (unsigned long long)hash_vram(&system));
+
+        pacer_wait(&pacer);
+    }
+
+    double elapsed = now() - start;
+    pacer_free(&pacer);
+
+    printf("%ld frames, %lld cycles in %.3f s (%.2f MHz, %.1fx realtime)\n",
+            frame, total, elapsed, total / elapsed / 1e6,
+            frame / elapsed / FRAMERATE);
+
+    if (rewind) {
+        uint64_t expected = hash_vram(&system);
+        uint16_t expected_pc = system.state->pc;
+
+        int back = rewind_back(rewind, &system, rewind_by);
+        for (int i = 0; i < back; i++)
+            run_frame(&system);
+
+        bool same = hash_vram(&system) == expected
+            && system.state->pc == expected_pc;
+        printf("Rewound %d frames (%.2f us a frame to record), the replay %s\n",
+                back, rewind_time / frame * 1e6, same ? "matches" : "differs");
+
+        rewind_free(rewind);
+        if (!same)
+            exit(1);
+    }
+
+    if (save_path) {
+        snapshot_take(&system, &snapshot);
+        if (snapshot_save(&snapshot, save_path) != 0)
+            exit(1);
+    }
+
+    free_system(&system);
+#endif
+
+    return 0;
+}
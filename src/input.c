@@ -1,3 +1,4 @@
+#include <SDL2/SDL.h>
 #include "input.h"
 
 void keyHandler(SDL_KeyboardEvent *event, Input *input, int down) {
@@ -31,6 +32,9 @@ void keyHandler(SDL_KeyboardEvent *event, Input *input, int down) {
         case SDL_SCANCODE_C:
             input->coin = down;
             break;
+        case SDL_SCANCODE_BACKSPACE:
+            input->rewind = down;
+            break;
         default:
             break;
         }
@@ -1,4 +1,13 @@
-#include <SDL2/SDL.h>
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdint.h>
+
+// The game's inputs, in a fixed order for save states and input scripts
+#define INPUTS(X) \
+    X(left1) X(right1) X(shot1) X(start1) \
+    X(left2) X(right2) X(shot2) X(start2) \
+    X(coin)
 
 typedef struct {
     int left1;
@@ -10,9 +19,31 @@ typedef struct {
     int shot2;
     int start2;
     int coin;
+    int rewind;
     int quit;
 } Input;
 
-void keyUpHandler(SDL_KeyboardEvent *event, Input *input);
-void keyDownHandler(SDL_KeyboardEvent *event, Input *input);
 void handleInput(Input *input);
+
+// The INPUTS packed a bit each, in order, lowest first
+
+#define INPUT_BIT(name) \
+    bits |= input->name ? bit : 0; \
+    bit <<= 1;
+
+static inline uint32_t input_bits(const Input *input) {
+    uint32_t bits = 0, bit = 1;
+    INPUTS(INPUT_BIT)
+    return bits;
+}
+
+#define SET_INPUT_BIT(name) \
+    input->name = (bits & bit) != 0; \
+    bit <<= 1;
+
+static inline void set_input_bits(Input *input, uint32_t bits) {
+    uint32_t bit = 1;
+    INPUTS(SET_INPUT_BIT)
+}
+
+#endif
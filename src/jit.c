@@ -0,0 +1,417 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "jit.h"
+#include "disassembler.h"
+
+// Profiling and tracing need every op interpreted
+#if defined(__x86_64__) && !FLAT_MEMORY && !PROFILE && !TRACE
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Straight-line runs of 8080 code are translated into x86_64 code that calls
+// each opcode's handler from op_table in turn with its operand baked in, doing
+// the pc++ and cycle accounting inline, so no fetch, decode or dispatch is left
+// at run time. Like run_cycles, a block stops at the first instruction
+// boundary that reaches the budget it's given. Blocks are cached by their
+// start pc, and dropped when their page is written to.
+
+#define CODE_SIZE (1 << 20) // translated code arena
+#define BLOCK_MAX_OPS 64
+#define BLOCK_MAX_BYTES (BLOCK_MAX_OPS * 51 + 64) // worst case per op, plus entry/exit
+#define HOT_THRESHOLD 8 // times a pc is interpreted before it's translated
+
+typedef int (*Block)(Cpu_state *state, int budget);
+
+typedef struct {
+    Block blocks[0x10000]; // translated block starting at each pc, if any
+    uint8_t heat[0x10000];
+    uint8_t *code;
+    size_t code_used;
+    volatile uint8_t invalidated; // set when a running block's page is written
+} Jit;
+
+// -- Opcode properties --
+
+// Left to the interpreter: IO, HLT and the undocumented opcodes
+static bool translatable(uint8_t op_code) {
+    switch (op_code) {
+    case 0x08: case 0x10: case 0x18: case 0x20: case 0x28: case 0x30:
+    case 0x38: case 0xcb: case 0xd9: case 0xdd: case 0xed: case 0xfd:
+    case 0x76: case 0xd3: case 0xdb:
+        return false;
+    }
+    return true;
+}
+
+// Anything that can change pc other than by falling through
+static bool ends_block(uint8_t op_code) {
+    if ((op_code & 0xc7) == 0xc0 // Rcc
+            || (op_code & 0xc7) == 0xc2 // Jcc
+            || (op_code & 0xc7) == 0xc4 // Ccc
+            || (op_code & 0xc7) == 0xc7) // RST
+        return true;
+
+    return op_code == 0xc3 || op_code == 0xc9 || op_code == 0xcd
+        || op_code == 0xe9;
+}
+
+// Stores that could hit the block's own code
+static bool writes_memory(uint8_t op_code) {
+    switch (op_code) {
+    case 0x02: case 0x12: case 0x22: case 0x32: // STAX, SHLD, STA
+    case 0x34: case 0x35: case 0x36: // INR M, DCR M, MVI M
+    case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x77:
+    case 0xc5: case 0xd5: case 0xe5: case 0xf5: // PUSH
+    case 0xe3: // XTHL
+        return true;
+    }
+    return false;
+}
+
+// Number of instructions in the block starting at pc, which stays inside one
+// page so that the page's code watch covers it
+static int count_ops(Cpu_state *state, uint16_t pc) {
+    int ops = 0;
+    uint16_t start = pc;
+
+    while (ops < BLOCK_MAX_OPS) {
+        uint8_t op_code = read_memory(state, pc);
+        if (!translatable(op_code)
+                || (pc >> PAGE_SHIFT) != ((pc + op_length[op_code] - 1) >> PAGE_SHIFT)
+                || (pc >> PAGE_SHIFT) != (start >> PAGE_SHIFT))
+            break;
+        ops++;
+        pc += op_length[op_code];
+        if (ends_block(op_code))
+            break;
+    }
+
+    return ops;
+}
+
+// -- Code emission --
+
+static void emit(Jit *jit, int count, ...) {
+    va_list bytes;
+    va_start(bytes, count);
+    for (int i = 0; i < count; i++)
+        jit->code[jit->code_used++] = va_arg(bytes, int);
+    va_end(bytes);
+}
+
+static void emit64(Jit *jit, uint64_t value) {
+    memcpy(&jit->code[jit->code_used], &value, 8);
+    jit->code_used += 8;
+}
+
+static void emit32(Jit *jit, uint32_t value) {
+    memcpy(&jit->code[jit->code_used], &value, 4);
+    jit->code_used += 4;
+}
+
+// The arena is never writable and executable at once. The pages a block is
+// emitted into are made writable for the translation, then executable again.
+static void protect_code(Jit *jit, size_t from, size_t to, int prot) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = from / page * page;
+    size_t end = (to + page - 1) / page * page;
+
+    if (end > start && mprotect(&jit->code[start], end - start, prot) != 0) {
+        printf("Could not protect translated code\n");
+        exit(1);
+    }
+}
+
+static Block translate(Jit *jit, Cpu_state *state, uint16_t start) {
+    if (jit->code_used + BLOCK_MAX_BYTES > CODE_SIZE) {
+        // Out of room, start over
+        memset(jit->blocks, 0, sizeof(jit->blocks));
+        jit->code_used = 0;
+    }
+
+    int ops = count_ops(state, start);
+
+    if (ops == 0)
+        return NULL;
+
+    size_t code_start = jit->code_used;
+    protect_code(jit, code_start, code_start + BLOCK_MAX_BYTES,
+            PROT_READ | PROT_WRITE);
+
+    uint8_t *block = &jit->code[jit->code_used];
+    uint32_t exit_jumps[2 * BLOCK_MAX_OPS];
+    int exits = 0;
+    uint16_t pc = start;
+
+    emit(jit, 1, 0x53); // push rbx
+    emit(jit, 2, 0x41, 0x54); // push r12
+    emit(jit, 2, 0x41, 0x55); // push r13
+    emit(jit, 2, 0x41, 0x56); // push r14
+    emit(jit, 4, 0x48, 0x83, 0xec, 0x08); // sub rsp, 8, keeps the stack 16 byte aligned
+    emit(jit, 3, 0x48, 0x89, 0xfb); // mov rbx, rdi
+    emit(jit, 3, 0x41, 0x89, 0xf6); // mov r14d, esi
+    emit(jit, 3, 0x45, 0x31, 0xe4); // xor r12d, r12d
+    emit(jit, 2, 0x49, 0xbd); // mov r13, &jit->invalidated
+    emit64(jit, (uint64_t)(uintptr_t)&jit->invalidated);
+
+    for (int i = 0; i < ops; i++) {
+        uint8_t op_code = read_memory(state, pc);
+
+        emit(jit, 3, 0x48, 0x89, 0xdf); // mov rdi, rbx
+        emit(jit, 1, 0xbe); // mov esi, operand
+        emit32(jit, fetch_operand(state, pc, op_length[op_code]));
+        emit(jit, 2, 0x48, 0xb8); // mov rax, handler
+        emit64(jit, (uint64_t)(uintptr_t)op_table[op_code]);
+        emit(jit, 2, 0xff, 0xd0); // call rax
+        emit(jit, 3, 0x41, 0x01, 0xc4); // add r12d, eax
+        emit(jit, 4, 0x66, 0xff, 0x43, (int)offsetof(Cpu_state, pc)); // inc word [rbx + pc]
+
+        pc += op_length[op_code];
+
+        if (i == ops - 1)
+            break;
+
+        // Stop once the budget is spent
+        emit(jit, 3, 0x45, 0x39, 0xf4); // cmp r12d, r14d
+        emit(jit, 2, 0x0f, 0x8d); // jge exit
+        exit_jumps[exits++] = jit->code_used;
+        emit32(jit, 0);
+
+        // or if the block's own code was overwritten
+        if (writes_memory(op_code)) {
+            emit(jit, 5, 0x41, 0x80, 0x7d, 0x00, 0x00); // cmp byte [r13], 0
+            emit(jit, 2, 0x0f, 0x85); // jne exit
+            exit_jumps[exits++] = jit->code_used;
+            emit32(jit, 0);
+        }
+    }
+
+    for (int i = 0; i < exits; i++) {
+        uint32_t rel = jit->code_used - (exit_jumps[i] + 4);
+        memcpy(&jit->code[exit_jumps[i]], &rel, 4);
+    }
+
+    emit(jit, 3, 0x44, 0x89, 0xe0); // mov eax, r12d
+    emit(jit, 4, 0x48, 0x83, 0xc4, 0x08); // add rsp, 8
+    emit(jit, 2, 0x41, 0x5e); // pop r14
+    emit(jit, 2, 0x41, 0x5d); // pop r13
+    emit(jit, 2, 0x41, 0x5c); // pop r12
+    emit(jit, 1, 0x5b); // pop rbx
+    emit(jit, 1, 0xc3); // ret
+
+    protect_code(jit, code_start, code_start + BLOCK_MAX_BYTES,
+            PROT_READ | PROT_EXEC);
+    watch_code_page(state, start >> PAGE_SHIFT);
+
+    jit->blocks[start] = (Block)(uintptr_t)block;
+    return jit->blocks[start];
+}
+
+static void code_written(Cpu_state *state, int page) {
+    Jit *jit = state->jit;
+
+    memset(&jit->blocks[page << PAGE_SHIFT], 0, PAGE_SIZE * sizeof(Block));
+    jit->invalidated = 1;
+}
+
+// -- Verification --
+
+#if JIT_VERIFY
+typedef struct {
+    Cpu_state state;
+    uint8_t flags;
+    uint8_t memory[0x10000];
+} Snapshot;
+
+static void save(Cpu_state *state, Snapshot *snapshot) {
+    snapshot->state = *state;
+    snapshot->flags = read_flags(state);
+
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (state->map.read[page])
+            memcpy(&snapshot->memory[page << PAGE_SHIFT], state->map.read[page],
+                    PAGE_SIZE);
+    }
+}
+
+// Only writable pages can have changed, ROM may be mapped read-only
+static void restore(Cpu_state *state, Snapshot *snapshot) {
+    Memory_map map = state->map; // keep the current code watches
+
+    *state = snapshot->state;
+    state->map = map;
+
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (state->map.read[page]
+                && (state->map.write[page] || state->map.traps[page]))
+            memcpy(state->map.read[page], &snapshot->memory[page << PAGE_SHIFT],
+                    PAGE_SIZE);
+    }
+}
+
+static bool same(Snapshot *a, Snapshot *b) {
+    return memcmp(a->state.regs, b->state.regs, sizeof(a->state.regs)) == 0
+        && a->state.sp == b->state.sp
+        && a->state.pc == b->state.pc
+        && a->flags == b->flags
+        && a->state.int_enable == b->state.int_enable
+        && memcmp(a->memory, b->memory, sizeof(a->memory)) == 0;
+}
+
+static void print_snapshot(char *name, Snapshot *snapshot) {
+    Cpu_state *state = &snapshot->state;
+    printf("%s: PC %04x SP %04x F %02x A %02x B %02x C %02x D %02x E %02x H %02x L %02x\n",
+            name, state->pc, state->sp, snapshot->flags, state->regs[A],
+            state->regs[B], state->regs[C], state->regs[D], state->regs[E],
+            state->regs[H], state->regs[L]);
+}
+
+// Runs the block's first count instructions on the interpreter, then the
+// translation up to the same cycle from the same starting point. Returns
+// whether the two agree.
+static bool run_both(Jit *jit, Cpu_state *state, Block block, int count,
+        int budget, Snapshot *before, Snapshot *expected, Snapshot *actual,
+        int *cyc) {
+    int expected_cyc = 0;
+
+    restore(state, before);
+    for (int i = 0; i < count && expected_cyc < budget; i++)
+        expected_cyc += emulate_op(state);
+    save(state, expected);
+
+    restore(state, before);
+    watch_code_page(state, before->state.pc >> PAGE_SHIFT); // if the run dropped it
+    jit->invalidated = 0;
+    *cyc = block(state, expected_cyc < budget ? expected_cyc : budget);
+    save(state, actual);
+
+    return jit->invalidated // self-modifying, the block stopped early
+        || (*cyc == expected_cyc && same(expected, actual));
+}
+
+// Runs the block on the interpreter first, then on the translation from the
+// same starting point, and compares the two. If they disagree, both are run
+// again to each instruction boundary in turn to find the first instruction
+// the translation gets wrong. Handled pages (memory mapped IO) would see
+// their accesses more than once, so this is for plain RAM and ROM machines.
+static int run_verified(Jit *jit, Cpu_state *state, Block block, int ops,
+        int budget) {
+    static Snapshot before, expected, actual;
+    int cyc;
+
+    save(state, &before);
+    if (run_both(jit, state, block, ops, budget, &before, &expected, &actual,
+                &cyc))
+        return cyc;
+
+    uint16_t pc = before.state.pc;
+
+    for (int count = 1; count <= ops; count++) {
+        if (!run_both(jit, state, block, count, budget, &before, &expected,
+                    &actual, &cyc)) {
+            printf("Translated block disagrees with the interpreter on "
+                    "instruction %d at %04x: ", count, pc);
+            fdisassemble_op(stdout, before.memory, pc);
+            printf("\n");
+            print_snapshot("block start", &before);
+            print_snapshot("interpreter", &expected);
+            print_snapshot("translation", &actual);
+            exit(1);
+        }
+
+        pc += op_length[before.memory[pc]]; // straight-line up to the last op
+    }
+
+    printf("Translated block at %04x disagrees with the interpreter\n",
+            before.state.pc);
+    exit(1);
+}
+
+#endif
+
+// -- Exported functions --
+
+int jit_init(Cpu_state *state) {
+    Jit *jit = calloc(1, sizeof(Jit));
+
+    jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (jit->code == MAP_FAILED) {
+        printf("Could not map memory for translated code, interpreting\n");
+        free(jit);
+        return -1;
+    }
+
+    state->jit = jit;
+    state->code_written = code_written;
+    return 0;
+}
+
+void jit_free(Cpu_state *state) {
+    Jit *jit = state->jit;
+
+    if (!jit)
+        return;
+
+    munmap(jit->code, CODE_SIZE);
+    free(jit);
+    state->jit = NULL;
+    state->code_written = NULL;
+}
+
+int jit_run_cycles(Cpu_state *state, int budget) {
+    Jit *jit = state->jit;
+
+    if (!jit)
+        return run_cycles(state, budget);
+
+    int cyc = 0;
+
+    while (cyc < budget) {
+        uint16_t pc = state->pc;
+        Block block = jit->blocks[pc];
+
+        if (!block && jit->heat[pc] >= HOT_THRESHOLD) {
+            block = translate(jit, state, pc);
+            if (!block)
+                jit->heat[pc] = 0; // starts with IO or HLT, retry later
+        }
+
+        if (block) {
+#if JIT_VERIFY
+            cyc += run_verified(jit, state, block, count_ops(state, pc),
+                    budget - cyc);
+#else
+            jit->invalidated = 0;
+            cyc += block(state, budget - cyc);
+#endif
+        } else {
+            if (jit->heat[pc] < HOT_THRESHOLD)
+                jit->heat[pc]++;
+            cyc += emulate_op(state);
+        }
+    }
+
+    return cyc - budget;
+}
+
+#else
+
+int jit_init(Cpu_state *state) {
+    (void)state;
+    return -1;
+}
+
+void jit_free(Cpu_state *state) {
+    (void)state;
+}
+
+int jit_run_cycles(Cpu_state *state, int budget) {
+    return run_cycles(state, budget);
+}
+
+#endif
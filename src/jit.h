@@ -0,0 +1,15 @@
+#include "cpu.h"
+
+// Run the frame loop through the basic block translator. Only x86_64 hosts
+// with a paged memory map are supported, elsewhere jit_init fails and
+// jit_run_cycles is just run_cycles.
+#define JIT 0
+
+// Check every translated block against the interpreter before running it. On
+// a mismatch, each instruction boundary in the block is checked in turn to
+// find the first instruction the translation gets wrong.
+#define JIT_VERIFY 0
+
+int jit_init(Cpu_state *state);
+void jit_free(Cpu_state *state);
+int jit_run_cycles(Cpu_state *state, int budget);
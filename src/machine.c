@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "machine.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
+
+void load_rom_file(char *filename, uint8_t *memory, int max_size) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        printf("Could not open %s\n", filename);
+        exit(1);
+    }
+
+    fseek(f, 0, SEEK_END);
+    int fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if (fsize > max_size) {
+        printf("File too large to load: %s\n", filename);
+        exit(1);
+    }
+
+    int bytes_read;
+    bytes_read = fread(memory, 1, fsize, f);
+    fclose(f);
+
+    if (bytes_read != fsize) {
+        printf("Failed to fully read file: %s\n", filename);
+        exit(1);
+    }
+}
+
+// Registers and handlers, everything but the memory
+static void reset_state(Cpu_state *state) {
+    state->pc = 0;
+    state->sp = 0;
+    state->int_enable = 0;
+    write_flags(state, 0);
+    for (int i = 0; i < 7; i++)
+        state->regs[i] = 0;
+    clear_ports(state);
+    state->code_written = NULL;
+    state->jit = NULL;
+    state->profile = NULL;
+    state->trace = NULL;
+#if !FLAT_MEMORY
+    clear_memory_map(state);
+#endif
+#if PROFILE
+    profile_init(state);
+#endif
+#if TRACE
+    trace_init(state);
+#endif
+}
+
+// A CP/M program at 0x100 in 64K of RAM
+int initalise_state(Cpu_state *state, char *rom_path) {
+    reset_state(state);
+
+    state->memory = calloc(MEMORY_SIZE, 1);
+    load_rom_file(rom_path, &state->memory[0x100], MEMORY_SIZE - 0x100);
+#if !FLAT_MEMORY
+    map_memory(state, 0x0000, MEMORY_SIZE, state->memory, true);
+#endif
+
+    return 0;
+}
+
+// -- Space Invaders ROM --
+
+static const char *rom_chip_files[ROM_CHIPS] = {
+    "invaders.h", "invaders.g", "invaders.f", "invaders.e"
+};
+
+// Maps a ROM chip's file read-only. The chips are only a quarter of a host
+// page, so each gets its own mapping rather than all four being contiguous.
+static const uint8_t *map_rom_chip(char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Could not open %s\n", filename);
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != ROM_CHIP_SIZE) {
+        printf("Expected %s to be %d bytes\n", filename, ROM_CHIP_SIZE);
+        exit(1);
+    }
+
+    void *chip = mmap(NULL, ROM_CHIP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (chip == MAP_FAILED) {
+        printf("Could not map %s\n", filename);
+        exit(1);
+    }
+
+    return chip;
+}
+
+#if DECODE_CACHE
+// Decodes the whole ROM once for all the systems sharing it, so none of them
+// need a decode cache of their own for it
+static const Decoded *decode_rom(Rom *rom) {
+    size_t size = ROM_SIZE * sizeof(Decoded);
+    Decoded *decoded = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (decoded == MAP_FAILED) {
+        printf("Could not map memory for the decoded ROM\n");
+        exit(1);
+    }
+
+    for (int page = 0; page < ROM_SIZE / PAGE_SIZE; page++) {
+        int chip = page * PAGE_SIZE / ROM_CHIP_SIZE;
+        decode_page(&rom->chips[chip][page * PAGE_SIZE % ROM_CHIP_SIZE],
+                &decoded[page * PAGE_SIZE]);
+    }
+
+    mprotect(decoded, size, PROT_READ);
+    return decoded;
+}
+#endif
+
+// The Space Invaders ROM, mapped straight from its files. It's never
+// written, so any number of systems can share one.
+Rom *load_rom(char *rom_path) {
+    Rom *rom = malloc(sizeof(Rom));
+    char filepath[100];
+
+    for (int i = 0; i < ROM_CHIPS; i++) {
+        snprintf(filepath, sizeof(filepath), "%s/%s", rom_path, rom_chip_files[i]);
+        rom->chips[i] = map_rom_chip(filepath);
+    }
+#if DECODE_CACHE
+    rom->decoded = decode_rom(rom);
+#endif
+
+    return rom;
+}
+
+void free_rom(Rom *rom) {
+    if (!rom)
+        return;
+
+    for (int i = 0; i < ROM_CHIPS; i++)
+        munmap((void *)rom->chips[i], ROM_CHIP_SIZE);
+#if DECODE_CACHE
+    munmap((void *)rom->decoded, ROM_SIZE * sizeof(Decoded));
+#endif
+    free(rom);
+}
+
+// Each system has its own RAM, the ROM is mapped in as it is
+static void initialise_invaders_memory(Arcade_system *system, const Rom *rom) {
+    Cpu_state *state = system->state;
+
+#if FLAT_MEMORY
+    state->memory = calloc(MEMORY_SIZE, 1);
+    for (int i = 0; i < ROM_CHIPS; i++)
+        memcpy(&state->memory[i * ROM_CHIP_SIZE], rom->chips[i], ROM_CHIP_SIZE);
+    system->ram = &state->memory[RAM_START];
+#else
+    state->memory = calloc(RAM_SIZE, 1);
+    system->ram = state->memory;
+
+    // Read-only, so the casts are never written through
+    for (int i = 0; i < ROM_CHIPS; i++)
+        map_memory(state, i * ROM_CHIP_SIZE, ROM_CHIP_SIZE,
+                (uint8_t *)rom->chips[i], false);
+    map_memory(state, RAM_START, RAM_SIZE, state->memory, true);
+    map_memory(state, RAM_START + RAM_SIZE, RAM_SIZE, state->memory, true); // Mirror
+#endif
+#if DECODE_CACHE
+    for (int page = 0; page < ROM_SIZE / PAGE_SIZE; page++)
+        map_decoded(state, page, (Decoded *)&rom->decoded[page * PAGE_SIZE]);
+#endif
+}
+
+// -- Space Invaders IO --
+//
+// The inputs are read from ports 1 and 2, the rest is the shift register the
+// game draws sprites at any pixel offset with. Ports nothing is mapped to
+// read back A.
+
+static uint8_t player1_IN(void *context, uint8_t port) {
+    Input *input = context;
+    (void)port;
+
+    return input->coin
+        | (input->start2 << 1)
+        | (input->start1 << 2)
+        | (1 << 3)
+        | (input->shot1 << 4)
+        | (input->left1 << 5)
+        | (input->right1 << 6);
+}
+
+static uint8_t player2_IN(void *context, uint8_t port) {
+    Input *input = context;
+    (void)port;
+
+    return (input->shot2 << 4)
+        | (input->left2 << 5)
+        | (input->right2 << 6);
+}
+
+static uint8_t shift_result_IN(void *context, uint8_t port) {
+    Port *shifter = context;
+    (void)port;
+
+    return shifter->shift >> (8 - shifter->offset);
+}
+
+static void shift_offset_OUT(void *context, uint8_t port, uint8_t value) {
+    Port *shifter = context;
+    (void)port;
+
+    shifter->offset = value & 0x07;
+}
+
+static void shift_data_OUT(void *context, uint8_t port, uint8_t value) {
+    Port *shifter = context;
+    (void)port;
+
+    shifter->shift = (shifter->shift >> 8) | (value << 8);
+}
+
+static void map_invaders_ports(Arcade_system *system) {
+    Cpu_state *state = system->state;
+
+    map_port_in(state, 1, player1_IN, system->input);
+    map_port_in(state, 2, player2_IN, system->input);
+    map_port_in(state, 3, shift_result_IN, system->port);
+    map_port_out(state, 2, shift_offset_OUT, system->port);
+    map_port_out(state, 4, shift_data_OUT, system->port);
+}
+
+// -- System --
+
+// The ports refer back to system, so it must stay put while it's running
+void initialise_system_with_rom(Arcade_system *system, const Rom *rom) {
+    system->state = malloc(sizeof(Cpu_state));
+    reset_state(system->state);
+    initialise_invaders_memory(system, rom);
+    system->own_rom = NULL;
+
+    system->input = malloc(sizeof(Input));
+    system->input->left1 = 0;
+    system->input->right1 = 0;
+    system->input->shot1 = 0;
+    system->input->start1 = 0;
+    system->input->left2 = 0;
+    system->input->right2 = 0;
+    system->input->shot2 = 0;
+    system->input->start2 = 0;
+    system->input->coin = 0;
+    system->input->quit = 0;
+    system->input->rewind = 0;
+
+    system->port = malloc(sizeof(Port));
+    system->port->offset = 0;
+    system->port->shift = 0;
+
+    system->display = NULL;
+    system->screen = NULL;
+    system->cycles = 0;
+    reset_events(system, 0);
+
+    map_invaders_ports(system);
+
+#if JIT
+    jit_init(system->state);
+#endif
+}
+
+// A system with its own copy of the ROM, freed along with it
+void initialise_system(Arcade_system *system, char *rom_path) {
+    Rom *rom = load_rom(rom_path);
+
+    initialise_system_with_rom(system, rom);
+    system->own_rom = rom;
+}
+
+void free_system(Arcade_system *system) {
+#if PROFILE
+    profile_finish(system->state);
+#endif
+#if TRACE
+    trace_finish(system->state);
+#endif
+    jit_free(system->state);
+#if !FLAT_MEMORY
+    free_memory_map(system->state);
+#endif
+    free(system->state->memory);
+    free(system->state);
+    free(system->input);
+    free(system->port);
+    free_rom(system->own_rom);
+}
+
+// FNV-1a over the video RAM
+uint64_t hash_vram(Arcade_system *system) {
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (uint16_t i = 0; i < VRAM_SIZE; i++) {
+        hash ^= system->ram[VRAM_START - RAM_START + i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+// Which pages of the video RAM were written since the last call
+void take_dirty_vram(Arcade_system *system, bool dirty[VRAM_PAGES]) {
+#if FLAT_MEMORY
+    for (int page = 0; page < VRAM_PAGES; page++)
+        dirty[page] = true;
+    (void)system;
+#else
+    Cpu_state *state = system->state;
+
+    for (int page = 0; page < VRAM_PAGES; page++)
+        dirty[page] = state->map.dirty[(VRAM_START >> PAGE_SHIFT) + page]
+            & (1 << DIRTY_DISPLAY);
+    track_dirty_pages(state, VRAM_START, VRAM_SIZE, DIRTY_DISPLAY);
+#endif
+}
+
+// -- Events --
+
+static void mid_screen_event(void *context, uint64_t cycle, int arg) {
+    Arcade_system *system = context;
+    (void)arg;
+
+    system->cycles += interrupt(system->state, 1);
+    schedule_event(&system->events, cycle + FRAME_PERIOD, mid_screen_event,
+            system, 0);
+}
+
+static void vblank_event(void *context, uint64_t cycle, int arg) {
+    Arcade_system *system = context;
+    (void)arg;
+
+    system->cycles += interrupt(system->state, 2);
+    system->frame_start = cycle;
+    system->frame_ended = true;
+    schedule_event(&system->events, cycle + FRAME_PERIOD, vblank_event,
+            system, 0);
+}
+
+// Drops any pending events and starts them again for a frame that began cyc
+// cycles ago, as it is when a snapshot is restored
+void reset_events(Arcade_system *system, int cyc) {
+    system->frame_start = system->cycles - cyc;
+    scheduler_clear(&system->events);
+
+    schedule_event(&system->events, system->frame_start + CYCLES_PER_HALF_FRAME,
+            mid_screen_event, system, 0);
+    schedule_event(&system->events, system->frame_start + FRAME_PERIOD,
+            vblank_event, system, 0);
+}
+
+// When the beam reaches the line, counting from the vblank interrupt. Each
+// half of the frame is split evenly between its 128 lines.
+static uint64_t line_cycle(Arcade_system *system, int line) {
+    int half = line / (LINES / 2);
+
+    return system->frame_start + half * CYCLES_PER_HALF_FRAME
+        + (line % (LINES / 2)) * CYCLES_PER_HALF_FRAME / (LINES / 2);
+}
+
+// Latches the line into the screen and waits for the next one
+static void line_event(void *context, uint64_t cycle, int line) {
+    Arcade_system *system = context;
+    int visible = line - (LINES - VISIBLE_LINES);
+    (void)cycle;
+
+    memcpy(&system->screen[visible * LINE_BYTES],
+            &system->ram[VRAM_START - RAM_START + visible * LINE_BYTES],
+            LINE_BYTES);
+    if (line + 1 < LINES)
+        schedule_event(&system->events, line_cycle(system, line + 1),
+                line_event, system, line + 1);
+}
+
+// Runs the CPU up to the soonest event, carrying any overshoot, then runs
+// the event
+static void run_next_event(Arcade_system *system) {
+    uint64_t due = next_event_cycle(&system->events);
+
+    if (system->cycles < due) {
+        int budget = due - system->cycles;
+        system->cycles += budget + jit_run_cycles(system->state, budget);
+    }
+
+    Event event = pop_event(&system->events);
+    event.handler(event.context, event.cycle, event.arg);
+}
+
+// Runs one frame, from just after one vblank interrupt to just after the
+// next, with the mid screen interrupt halfway. With a screen, the CPU is
+// stopped as the beam reaches each visible line to latch it, so the screen
+// shows each line as it was when it was drawn rather than how the frame
+// ended. Returns the cycles run.
+int run_frame(Arcade_system *system) {
+    uint64_t start = system->cycles;
+    int first_line = LINES - VISIBLE_LINES;
+
+    if (system->screen)
+        schedule_event(&system->events, line_cycle(system, first_line),
+                line_event, system, first_line);
+
+    system->frame_ended = false;
+    while (!system->frame_ended)
+        run_next_event(system);
+
+    return system->cycles - start;
+}
+
+#if CPUDIAG
+// Runs a CP/M program, CPUDIAG if rom_path is NULL. Doesn't return, the
+// program exits through a warm boot.
+void run_cpm_program(char *rom_path) {
+    Cpu_state state;
+    initalise_state(&state, rom_path ? rom_path : "rom/cpudiag.bin");
+
+    state.pc = 0x100;
+    state.memory[0x0000] = 0x76; // HLT on warm boot
+    state.memory[0x0006] = 0x00; // BDOS entry, read as the top of memory
+    state.memory[0x0007] = 0xff;
+
+    if (!rom_path)
+        state.memory[368] = 0x7; // fix CPUDIAG's stack pointer
+
+    while (true)
+        run_cycles(&state, 1000000);
+}
+#endif
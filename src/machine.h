@@ -0,0 +1,79 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include "cpu.h"
+#include "input.h"
+#include "scheduler.h"
+
+// Everything but the display and the SDL frontend, so that the headless
+// runner can be linked without SDL.
+
+#define FRAMERATE 60
+#define CYCLES_PER_FRAME (2000000 / FRAMERATE)
+#define CYCLES_PER_HALF_FRAME (CYCLES_PER_FRAME / 2) // between the interrupts
+#define FRAME_PERIOD (2 * CYCLES_PER_HALF_FRAME) // vblank to vblank
+
+// The beam draws 224 lines, one 32 byte line of VRAM each, then spends 32
+// more in vblank. A frame here starts with the vblank interrupt, so the mid
+// screen interrupt half a frame later lands as the beam reaches line 96.
+#define LINES 256
+#define VISIBLE_LINES 224
+#define LINE_BYTES 32
+
+#define ROM_SIZE 0x2000
+#define ROM_CHIPS 4
+#define ROM_CHIP_SIZE (ROM_SIZE / ROM_CHIPS)
+#define RAM_START 0x2000
+#define RAM_SIZE 0x2000
+#define VRAM_START 0x2400
+#define VRAM_SIZE 0x1c00
+#define VRAM_PAGES (VRAM_SIZE / PAGE_SIZE) // each 8 columns of the screen
+
+// Dirty page trackers, see track_dirty_pages
+#define DIRTY_REWIND 0
+#define DIRTY_DISPLAY 1
+
+typedef struct {
+    uint16_t shift;
+    uint8_t offset;
+} Port;
+
+typedef struct {
+    const uint8_t *chips[ROM_CHIPS]; // invaders.h to invaders.e, read-only
+#if DECODE_CACHE
+    const Decoded *decoded; // every ROM page decoded, read-only
+#endif
+} Rom;
+
+struct Display;
+
+typedef struct {
+    Cpu_state *state;
+    struct Display *display; // left NULL, owned by the frontend
+    Input *input;
+    Port *port;
+    uint8_t *ram; // RAM_SIZE bytes seen at RAM_START
+    Rom *own_rom; // freed with the system, NULL if the ROM is shared
+    uint8_t *screen; // if set, VRAM_SIZE bytes latched as the beam passes
+    uint64_t cycles; // run since power on
+    uint64_t frame_start; // cycle of the vblank the current frame began at
+    bool frame_ended; // set by the vblank event
+    Scheduler events;
+} Arcade_system;
+
+void load_rom_file(char *filename, uint8_t *memory, int max_size);
+int initalise_state(Cpu_state *state, char *rom_path);
+Rom *load_rom(char *rom_path);
+void free_rom(Rom *rom);
+void initialise_system_with_rom(Arcade_system *system, const Rom *rom);
+void initialise_system(Arcade_system *system, char *rom_path);
+void free_system(Arcade_system *system);
+void reset_events(Arcade_system *system, int cyc);
+int run_frame(Arcade_system *system);
+uint64_t hash_vram(Arcade_system *system);
+void take_dirty_vram(Arcade_system *system, bool dirty[VRAM_PAGES]);
+#if CPUDIAG
+void run_cpm_program(char *rom_path);
+#endif
+
+#endif
@@ -1,242 +1,181 @@
 #include <SDL2/SDL_rect.h>
 #include <SDL2/SDL_render.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
 #include <SDL2/SDL.h>
 #include "cpu.h"
+#include "machine.h"
 #include "display.h"
 #include "input.h"
+#include "pacing.h"
+#include "rewind.h"
+#include "triple_buffer.h"
 
-#define FRAMERATE 60
-#define CYCLES_PER_FRAME 2000000 / FRAMERATE
+_Static_assert(VRAM_PAGES == BANDS, "a band of columns per page of VRAM");
 
-typedef struct {
-    uint16_t shift;
-    uint8_t offset;
-} Port;
-
-typedef struct {
-    Cpu_state *state;
-    Display *display;
-    Input *input;
-    Port *port;
-} Arcade_system;
-
-void load_rom_file(char *filename, uint8_t *memory) {
-    FILE *f = fopen(filename, "rb");
-    if (!f) {
-        printf("Could not open %s\n", filename);
-        exit(1);
-    }
-
-    fseek(f, 0, SEEK_END);
-    int fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    int bytes_read;
-    bytes_read = fread(memory, 1, fsize, f);
-    fclose(f);
-
-    if (bytes_read != fsize) {
-        printf("Failed to fully read file: %s\n", filename);
-        exit(1);
-    }
-}
-
-uint8_t *initalise_memory(char *rom_path) {
-    uint8_t *memory = malloc(sizeof(uint8_t) * 0x4000);
-    memset(memory, 0, 0x4000);
-
-#if CPUDIAG
-    load_rom_file(rom_path, &memory[0x100]);
-#else
-    char filepath[100];
-
-    strcpy(filepath, rom_path);
-    strcat(filepath, "/invaders.h");
-    load_rom_file(filepath, &memory[0x0000]);
-
-    strcpy(filepath, rom_path);
-    strcat(filepath, "/invaders.g");
-    load_rom_file(filepath, &memory[0x0800]);
-
-    strcpy(filepath, rom_path);
-    strcat(filepath, "/invaders.f");
-    load_rom_file(filepath, &memory[0x1000]);
-
-    strcpy(filepath, rom_path);
-    strcat(filepath, "/invaders.e");
-    load_rom_file(filepath, &memory[0x1800]);
-#endif
-
-    return memory;
-}
-
-int initalise_state(Cpu_state *state, char *rom_path) {
-    state->pc = 0;
-    state->sp = 0;
-    state->int_enable = 0;
-    state->cc.ac = 0;
-    state->cc.cy = 0;
-    state->cc.z = 0;
-    state->cc.s = 0;
-    state->cc.p = 0;
-    for (int i = 0; i < 7; i++)
-        state->regs[i] = 0;
-    state->memory = initalise_memory(rom_path);
-    return 0;
-}
-
-Arcade_system initialise_system() {
-    Arcade_system system;
-
-    system.state = malloc(sizeof(Cpu_state));
-    initalise_state(system.state, "rom");
-
-    system.input = malloc(sizeof(Input));
-    system.input->left1 = 0;
-    system.input->right1 = 0;
-    system.input->shot1 = 0;
-    system.input->start1 = 0;
-    system.input->left2 = 0;
-    system.input->right2 = 0;
-    system.input->shot2 = 0;
-    system.input->start2 = 0;
-    system.input->coin = 0;
-    system.input->quit = 0;
-
-    system.port = malloc(sizeof(Port));
-    system.port->offset = 0;
-    system.port->shift = 0;
-
-    system.display = malloc(sizeof(Display));
+void cleanup(Arcade_system *system) {
+    SDL_DestroyTexture(system->display->texture);
+    SDL_DestroyRenderer(system->display->renderer);
+    SDL_DestroyWindow(system->display->window);
+    SDL_Quit();
 
-    return system;
+    free(system->display);
+    free_system(system);
 }
 
-int invaders_IN(Arcade_system *system) {
-    uint8_t port = read_memory(system->state, system->state->pc + 1);
-
-    switch (port) {
-    case 1:
-        system->state->regs[A] = system->input->coin
-            | (system->input->start2 << 1)
-            | (system->input->start1 << 2)
-            | (1 << 3)
-            | (system->input->shot1 << 4)
-            | (system->input->left1 << 5)
-            | (system->input->right1 << 6);
-        break;
-    case 2:
-        system->state->regs[A] = (system->input->shot2 << 4)
-            | (system->input->left2 << 5)
-            | (system->input->right2 << 6);
-        break;
-    case 3:
-        system->state->regs[A] =
-            system->port->shift >> (8 - system->port->offset);
-        break;
-    }
+#if !CPUDIAG
+// The emulation runs on its own thread at a steady FRAMERATE, while the main
+// thread handles SDL: polling input, then converting and presenting the
+// newest frame. Neither waits for the other, so a slow present or vsync
+// can't hold up the emulation. Frames are latched a line at a time as the
+// emulated beam passes, so they don't tear when the game draws mid frame.
 
-    system->state->pc += 2;
-    return 10;
+typedef struct {
+    Arcade_system *system;
+    Triple_buffer frames;
+    atomic_uint input; // input_bits, from the main thread
+    atomic_bool rewind;
+    atomic_bool running;
+    Pacer pacer;
+    uint32_t last_dirty; // VRAM pages written in the last frame
+} Emulation;
+
+// The frame was latched into the back frame as it ran, unless it was
+// rewound instead
+static void publish_frame(Emulation *emulation, uint64_t number,
+        bool latched) {
+    Arcade_system *system = emulation->system;
+    Frame *frame = triple_buffer_back(&emulation->frames);
+    bool dirty[VRAM_PAGES];
+
+    if (!latched)
+        memcpy(frame->vram, &system->ram[VRAM_START - RAM_START], VRAM_SIZE);
+
+    // A line written after the beam passed it shows up a frame late, so the
+    // pages written in the frame before may have changed too
+    take_dirty_vram(system, dirty);
+    frame->dirty = emulation->last_dirty;
+    emulation->last_dirty = 0;
+    for (int page = 0; page < VRAM_PAGES; page++)
+        emulation->last_dirty |= (uint32_t)dirty[page] << page;
+    frame->dirty |= emulation->last_dirty;
+
+    frame->number = number;
+    triple_buffer_publish(&emulation->frames);
 }
 
-int invaders_OUT(Arcade_system *system) {
-    uint8_t port = read_memory(system->state, system->state->pc + 1);
-
-    switch (port) {
-    case 2:
-        system->port->offset = system->state->regs[A] & 0x07;
-        break;
-    case 4:
-        system->port->shift =
-            (system->port->shift >> 8) | (system->state->regs[A] << 8);
-        break;
-    }
-
-    system->state->pc += 2;
-    return 10;
-}
+static void *emulate(void *argument) {
+    Emulation *emulation = argument;
+    Arcade_system *system = emulation->system;
+    Rewind *rewind = rewind_init(system);
+    uint64_t number = 0;
+
+    while (atomic_load(&emulation->running)) {
+        set_input_bits(system->input, atomic_load(&emulation->input));
+        bool rewinding = atomic_load(&emulation->rewind);
+
+        if (rewinding) {
+            rewind_back(rewind, system, 1);
+        } else {
+            system->screen = triple_buffer_back(&emulation->frames)->vram;
+            run_frame(system);
+            system->screen = NULL;
+            rewind_push(rewind, system);
+        }
 
-int invaders_op(Arcade_system *system) {
-    uint8_t op_code = read_memory(system->state, system->state->pc);
-    int cyc = 0;
-
-    switch (op_code) {
-    case 0xdb:
-        cyc = invaders_IN(system);
-        break;
-    case 0xd3:
-        cyc = invaders_OUT(system);
-        break;
-    default:
-        cyc = emulate_op(system->state);
+        publish_frame(emulation, ++number, !rewinding);
+        pacer_wait(&emulation->pacer);
     }
 
-    return cyc;
-}
-
-void cleanup(Arcade_system system) {
-    SDL_DestroyTexture(system.display->texture);
-    SDL_DestroyRenderer(system.display->renderer);
-    SDL_DestroyWindow(system.display->window);
-    SDL_Quit();
-
-    free(system.state->memory);
-    free(system.state);
-    free(system.input);
-    free(system.port);
-    free(system.display);
+    rewind_free(rewind);
+    return NULL;
 }
+#endif
 
-int main() {
+int main(int argc, char **argv) {
 #if CPUDIAG
-    Cpu_state state;
-    initalise_state(&state, "rom/cpudiag.bin");
-
-    state.memory[0]=0xc3;
-    state.memory[1]=0x00;
-    state.memory[2]=0x01;
-    state.memory[368] = 0x7;
-
-    while (true)
-        emulate_op(&state);
+    // CPUDIAG by default, others such as 8080PRE, TST8080 or 8080EXM can be
+    // passed as the first argument
+    run_cpm_program(argc > 1 ? argv[1] : NULL);
 #else
-    Arcade_system system = initialise_system();
-
-    initialise_SDL(system.display);
-
-    //atexit(cleanup);
-
-    int cyc = 0;
-    u_int32_t timer = 0;
-    while (!system.input->quit) {
-        if ((SDL_GetTicks() - timer) > (1000 / FRAMERATE)) {
-            timer = SDL_GetTicks();
+    Pace_mode mode = PACE_REALTIME;
+    double multiplier = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        if (opt != 'p' || pacer_parse(optarg, &mode, &multiplier) != 0) {
+            printf("Usage: %s [-p realtime | uncapped | vsync | multiplier]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
 
-            handleInput(system.input);
+    Arcade_system system;
+    initialise_system(&system, "rom");
 
-            while (cyc < CYCLES_PER_FRAME / 2)
-                cyc += invaders_op(&system);
+    system.display = malloc(sizeof(Display));
+    initialise_SDL(system.display, mode == PACE_VSYNC);
 
-            cyc += interrupt(system.state, 1);
+    //atexit(cleanup);
 
-            while (cyc < CYCLES_PER_FRAME)
-                cyc += invaders_op(&system);
+    // The main thread's own copy, the system's belongs to the emulation
+    Input input = *system.input;
+
+    static Emulation emulation;
+    emulation.system = &system;
+    triple_buffer_init(&emulation.frames);
+    emulation.last_dirty = 0;
+    atomic_init(&emulation.input, 0);
+    atomic_init(&emulation.rewind, false);
+    atomic_init(&emulation.running, true);
+    pacer_init(&emulation.pacer, mode, multiplier);
+
+    pthread_t emulation_thread;
+    if (pthread_create(&emulation_thread, NULL, emulate, &emulation) != 0) {
+        printf("Could not start the emulation thread\n");
+        exit(1);
+    }
 
-            cyc += interrupt(system.state, 2);
+    uint64_t shown = 0;
+    while (!input.quit) {
+        handleInput(&input);
+        atomic_store(&emulation.input, input_bits(&input));
+        atomic_store(&emulation.rewind, input.rewind);
+
+        // With vsync every refresh is presented, new frame or not, and
+        // paces the emulation
+        Frame *frame = triple_buffer_take(&emulation.frames);
+        if (!frame && mode != PACE_VSYNC) {
+            SDL_Delay(1);
+            continue;
+        }
 
-            cyc = CYCLES_PER_FRAME - cyc;
+        if (frame) {
+            // Frames in between were dropped, so their changes aren't in dirty
+            bool dirty[BANDS];
+            for (int band = 0; band < BANDS; band++)
+                dirty[band] = frame->number != shown + 1
+                    || (frame->dirty & (1u << band));
+            shown = frame->number;
 
-            prepareScene(system.display, system.state->memory);
-            presentScene(system.display);
+            prepareScene(system.display, frame->vram, dirty);
         }
+
+        presentScene(system.display);
+        if (mode == PACE_VSYNC)
+            pacer_vblank(&emulation.pacer);
     }
 
-    cleanup(system);
+    atomic_store(&emulation.running, false);
+    pthread_join(emulation_thread, NULL);
+    pacer_free(&emulation.pacer);
+
+    cleanup(&system);
 #endif
 
     return 0;
@@ -0,0 +1,101 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pacing.h"
+#include "machine.h"
+
+#define NS 1000000000LL
+
+static int64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS + ts.tv_nsec;
+}
+
+static struct timespec to_timespec(int64_t ns) {
+    struct timespec ts = {ns / NS, ns % NS};
+    return ts;
+}
+
+int pacer_parse(const char *text, Pace_mode *mode, double *multiplier) {
+    char *end;
+
+    *multiplier = 1;
+
+    if (strcmp(text, "realtime") == 0) {
+        *mode = PACE_REALTIME;
+    } else if (strcmp(text, "uncapped") == 0) {
+        *mode = PACE_UNCAPPED;
+    } else if (strcmp(text, "vsync") == 0) {
+        *mode = PACE_VSYNC;
+    } else {
+        *multiplier = strtod(text, &end);
+        if (*end != '\0' || !(*multiplier > 0)) {
+            printf("Unknown pacing %s, expected realtime, uncapped, vsync or "
+                    "a speed multiplier\n", text);
+            return -1;
+        }
+        *mode = PACE_MULTIPLIER;
+    }
+
+    return 0;
+}
+
+void pacer_init(Pacer *pacer, Pace_mode mode, double multiplier) {
+    pacer->mode = mode;
+    pacer->period = (double)NS / FRAMERATE
+        / (mode == PACE_MULTIPLIER ? multiplier : 1);
+    pacer->start = now();
+    pacer->frames = 0;
+    pacer->resyncs = 0;
+    sem_init(&pacer->vblank, 0, 0);
+}
+
+void pacer_free(Pacer *pacer) {
+    sem_destroy(&pacer->vblank);
+}
+
+// Waits until the next frame is due
+void pacer_wait(Pacer *pacer) {
+    switch (pacer->mode) {
+    case PACE_UNCAPPED:
+        return;
+
+    case PACE_VSYNC: {
+        // Timed, so that a renderer that has stopped can't hang the caller
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout = to_timespec(timeout.tv_sec * NS + timeout.tv_nsec + NS / 10);
+        while (sem_timedwait(&pacer->vblank, &timeout) != 0 && errno == EINTR)
+            ;
+        return;
+    }
+
+    case PACE_REALTIME:
+    case PACE_MULTIPLIER:
+        break;
+    }
+
+    int64_t deadline = pacer->start + (int64_t)(++pacer->frames * pacer->period);
+    int64_t current = now();
+
+    // After a stall, e.g. the process being stopped, carry on from now rather
+    // than running a burst of frames to catch up
+    if (current - deadline > PACE_RESYNC_FRAMES * pacer->period) {
+        pacer->start = current;
+        pacer->frames = 0;
+        pacer->resyncs++;
+        return;
+    }
+
+    struct timespec ts = to_timespec(deadline);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+// Called by the renderer once a frame has been presented
+void pacer_vblank(Pacer *pacer) {
+    sem_post(&pacer->vblank);
+}
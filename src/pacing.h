@@ -0,0 +1,41 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <semaphore.h>
+#include <stdint.h>
+
+// Frame pacing. Deadlines are worked out from the start of the run rather
+// than added up frame by frame, so rounding never accumulates into drift,
+// and waits sleep on absolute deadlines rather than spinning.
+//
+//   realtime   FRAMERATE frames a second, as on the cabinet
+//   uncapped   as fast as the host can go
+//   <n>        n times realtime, e.g. 2 or 0.5
+//   vsync      a frame each time the renderer calls pacer_vblank, for a
+//              display synced to its refresh rate
+
+#define PACE_RESYNC_FRAMES 4 // further behind than this, stop catching up
+
+typedef enum {
+    PACE_REALTIME,
+    PACE_UNCAPPED,
+    PACE_MULTIPLIER,
+    PACE_VSYNC
+} Pace_mode;
+
+typedef struct {
+    Pace_mode mode;
+    double period; // ns a frame
+    int64_t start; // ns, CLOCK_MONOTONIC, when frame 0 was due
+    uint64_t frames; // since start
+    uint64_t resyncs; // times the schedule was restarted after a stall
+    sem_t vblank; // posted by the renderer in PACE_VSYNC
+} Pacer;
+
+int pacer_parse(const char *text, Pace_mode *mode, double *multiplier);
+void pacer_init(Pacer *pacer, Pace_mode mode, double multiplier);
+void pacer_free(Pacer *pacer);
+void pacer_wait(Pacer *pacer);
+void pacer_vblank(Pacer *pacer);
+
+#endif
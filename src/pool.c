@@ -0,0 +1,120 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "pool.h"
+
+// The tasks a worker has left, [first, last). The owner takes from the
+// back, thieves from the front, so they only meet over the last task.
+typedef struct {
+    pthread_mutex_t lock;
+    int first;
+    int last;
+} Deque;
+
+typedef struct Pool Pool;
+
+typedef struct {
+    Pool *pool;
+    int index;
+    pthread_t thread;
+} Worker;
+
+struct Pool {
+    Deque *deques;
+    Worker *workers;
+    int threads;
+    Pool_task run;
+    void *context;
+};
+
+// One per online core
+int pool_threads() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+}
+
+static int take(Deque *deque) {
+    int task = -1;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->first < deque->last)
+        task = --deque->last;
+    pthread_mutex_unlock(&deque->lock);
+
+    return task;
+}
+
+static int steal(Deque *deque) {
+    int task = -1;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->first < deque->last)
+        task = deque->first++;
+    pthread_mutex_unlock(&deque->lock);
+
+    return task;
+}
+
+static void *work(void *argument) {
+    Worker *worker = argument;
+    Pool *pool = worker->pool;
+
+    while (true) {
+        int task = take(&pool->deques[worker->index]);
+
+        // Nothing new is ever queued, so once every deque has been found
+        // empty the worker is done
+        for (int i = 1; task < 0 && i < pool->threads; i++)
+            task = steal(&pool->deques[(worker->index + i) % pool->threads]);
+
+        if (task < 0)
+            return NULL;
+
+        pool->run(pool->context, task, worker->index);
+    }
+}
+
+// Runs tasks 0 to tasks - 1 on the given number of threads, returning once
+// they have all finished
+void pool_run(int tasks, int threads, Pool_task run, void *context) {
+    Pool pool;
+
+    if (threads > tasks)
+        threads = tasks;
+    if (threads < 1)
+        return;
+
+    pool.threads = threads;
+    pool.run = run;
+    pool.context = context;
+    pool.deques = malloc(threads * sizeof(Deque));
+    pool.workers = malloc(threads * sizeof(Worker));
+
+    // Contiguous shares, a thief takes the tasks the owner would reach last
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        pool.deques[i].first = (long)tasks * i / threads;
+        pool.deques[i].last = (long)tasks * (i + 1) / threads;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].index = i;
+
+        if (pthread_create(&pool.workers[i].thread, NULL, work,
+                    &pool.workers[i]) != 0) {
+            printf("Could not start worker thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < threads; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+
+    for (int i = 0; i < threads; i++)
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    free(pool.deques);
+    free(pool.workers);
+}
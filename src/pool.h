@@ -0,0 +1,13 @@
+#ifndef POOL_H
+#define POOL_H
+
+// Work-stealing thread pool for coarse tasks, such as whole emulator runs.
+// Each worker starts with its share of the tasks and, once it runs out,
+// steals from the others, so long and short tasks even out.
+
+typedef void (*Pool_task)(void *context, int task, int worker);
+
+int pool_threads();
+void pool_run(int tasks, int threads, Pool_task run, void *context);
+
+#endif
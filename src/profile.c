@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "profile.h"
+#include "disassembler.h"
+
+#define TOP_ROUTINES 50
+#define TOP_INSTRUCTIONS 100
+
+static Cpu_state *profiled; // reported at exit
+
+double profile_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void next_sample(Profile *profile) {
+    profile->seed ^= profile->seed << 13;
+    profile->seed ^= profile->seed >> 17;
+    profile->seed ^= profile->seed << 5;
+
+    // Randomised, so that loops can't keep sampling the same instructions
+    profile->until_sample = PROFILE_SAMPLE_INTERVAL / 2
+        + profile->seed % PROFILE_SAMPLE_INTERVAL;
+}
+
+static bool jumps(uint8_t op_code) {
+    return (op_code & 0xc7) == 0xc2 // Jcc
+        || (op_code & 0xc7) == 0xc0 // Rcc
+        || op_code == 0xc3 || op_code == 0xc9 || op_code == 0xe9; // JMP, RET, PCHL
+}
+
+void profile_record(Profile *profile, uint16_t pc, uint8_t op_code, int cyc,
+        double ns) {
+    // Got here by a call or an interrupt rather than the previous instruction
+    // running on into it or jumping, or through a vector's JMP
+    if ((pc != (uint16_t)(profile->last_pc + op_length[profile->last_op])
+                && !jumps(profile->last_op))
+            || (profile->last_op == 0xc3 && profile->entry_point[profile->last_pc]))
+        profile->entry_point[pc] = 1;
+
+    profile->last_pc = pc;
+    profile->last_op = op_code;
+
+    profile->ops[op_code].count++;
+    profile->ops[op_code].cycles += cyc;
+    profile->pcs[pc].count++;
+    profile->pcs[pc].cycles += cyc;
+
+    if (ns >= 0) {
+        ns -= profile->clock_overhead;
+        profile->ops[op_code].ns += ns;
+        profile->ops[op_code].samples++;
+        profile->pcs[pc].ns += ns;
+        profile->pcs[pc].samples++;
+        next_sample(profile);
+    }
+}
+
+// -- Report --
+
+typedef struct {
+    uint16_t key; // opcode or address
+    Profile_entry total;
+} Row;
+
+static int by_cycles(const void *a, const void *b) {
+    uint64_t x = ((Row *)a)->total.cycles, y = ((Row *)b)->total.cycles;
+    return (x < y) - (x > y);
+}
+
+static int by_time(const void *a, const void *b) {
+    double x = ((Row *)a)->total.ns, y = ((Row *)b)->total.ns;
+    return (x < y) - (x > y);
+}
+
+// The address space as the CPU sees it, without calling any read handlers
+static void snapshot_memory(Cpu_state *state, uint8_t *memory) {
+#if FLAT_MEMORY
+    memcpy(memory, state->memory, 0x10000);
+#else
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (state->map.read[page])
+            memcpy(&memory[page << PAGE_SHIFT], state->map.read[page], PAGE_SIZE);
+        else
+            memset(&memory[page << PAGE_SHIFT], 0, PAGE_SIZE);
+    }
+#endif
+}
+
+// Count, cycles, and shares of the cycles and of the sampled time
+static void print_row(FILE *out, Row *row, Profile_entry *total) {
+    fprintf(out, "%12llu %14llu %6.2f%% %6.2f%%  ",
+            (unsigned long long)row->total.count,
+            (unsigned long long)row->total.cycles,
+            100.0 * row->total.cycles / total->cycles,
+            total->ns > 0 ? 100.0 * row->total.ns / total->ns : 0);
+}
+
+void profile_report(Cpu_state *state, FILE *out) {
+    Profile *profile = state->profile;
+    static Row rows[0x10000];
+    static uint8_t memory[0x10000 + 2]; // room for a trailing operand
+    Profile_entry total = {0};
+
+    snapshot_memory(state, memory);
+
+    for (int op_code = 0; op_code < 0x100; op_code++) {
+        total.count += profile->ops[op_code].count;
+        total.cycles += profile->ops[op_code].cycles;
+        total.samples += profile->ops[op_code].samples;
+        total.ns += profile->ops[op_code].ns;
+    }
+
+    if (!total.count) {
+        fprintf(out, "Nothing was executed\n");
+        return;
+    }
+
+    // Sampled time scaled up to an estimate for the whole run
+    double scale = total.samples ? (double)total.count / total.samples : 0;
+
+    fprintf(out, "%llu instructions, %llu cycles, %llu timed (%.0f ns clock overhead), "
+            "about %.3f s in the interpreter\n",
+            (unsigned long long)total.count, (unsigned long long)total.cycles,
+            (unsigned long long)total.samples, profile->clock_overhead,
+            total.ns * scale / 1e9);
+
+    // -- Opcodes --
+
+    int count = 0;
+    for (int op_code = 0; op_code < 0x100; op_code++) {
+        if (profile->ops[op_code].count) {
+            rows[count].key = op_code;
+            rows[count++].total = profile->ops[op_code];
+        }
+    }
+    qsort(rows, count, sizeof(Row), by_time);
+
+    fprintf(out, "\n-- Opcodes, by host time --\n\n");
+    fprintf(out, "  op        count         cycles  cycles    time   ns/op  instruction\n");
+    for (int i = 0; i < count; i++) {
+        uint8_t op[3] = {rows[i].key, 0, 0};
+        Profile_entry *entry = &rows[i].total;
+
+        fprintf(out, "  %02x", rows[i].key);
+        print_row(out, &rows[i], &total);
+        fprintf(out, "%6.1f  ", entry->samples ? entry->ns / entry->samples : 0);
+        fdisassemble_op(out, op, 0);
+        fprintf(out, "\n");
+    }
+
+    // -- Routines --
+    //
+    // Each entry point owns the instructions up to the next one
+
+    count = 0;
+    for (int pc = 0; pc < 0x10000; pc++) {
+        if (profile->entry_point[pc] || count == 0) {
+            rows[count].key = pc;
+            memset(&rows[count++].total, 0, sizeof(Profile_entry));
+        }
+
+        Profile_entry *routine = &rows[count - 1].total;
+        routine->count += profile->pcs[pc].count;
+        routine->cycles += profile->pcs[pc].cycles;
+        routine->samples += profile->pcs[pc].samples;
+        routine->ns += profile->pcs[pc].ns;
+    }
+    qsort(rows, count, sizeof(Row), by_cycles);
+
+    fprintf(out, "\n-- Routines, by cycles --\n\n");
+    fprintf(out, "  addr        count         cycles  cycles    time  first instruction\n");
+    for (int i = 0; i < count && i < TOP_ROUTINES && rows[i].total.count; i++) {
+        fprintf(out, "  %04x", rows[i].key);
+        print_row(out, &rows[i], &total);
+        fdisassemble_op(out, memory, rows[i].key);
+        fprintf(out, "\n");
+    }
+
+    // -- Instructions --
+
+    count = 0;
+    for (int pc = 0; pc < 0x10000; pc++) {
+        if (profile->pcs[pc].count) {
+            rows[count].key = pc;
+            rows[count++].total = profile->pcs[pc];
+        }
+    }
+    qsort(rows, count, sizeof(Row), by_cycles);
+
+    fprintf(out, "\n-- Instructions, by cycles --\n\n");
+    fprintf(out, "  addr        count         cycles  cycles    time  instruction\n");
+    for (int i = 0; i < count && i < TOP_INSTRUCTIONS; i++) {
+        fprintf(out, "  %04x", rows[i].key);
+        print_row(out, &rows[i], &total);
+        fdisassemble_op(out, memory, rows[i].key);
+        fprintf(out, "\n");
+    }
+}
+
+static void write_report(Cpu_state *state) {
+    FILE *out = fopen(PROFILE_FILE, "w");
+
+    if (!out) {
+        printf("Could not write %s\n", PROFILE_FILE);
+        return;
+    }
+
+    profile_report(state, out);
+    fclose(out);
+    printf("Profile written to %s\n", PROFILE_FILE);
+}
+
+// For runs that end in exit() before profile_finish
+static void report_at_exit() {
+    if (profiled)
+        write_report(profiled);
+}
+
+// Starts profiling state, the report is written by profile_finish or when the
+// program exits
+void profile_init(Cpu_state *state) {
+    static bool registered;
+    Profile *profile = calloc(1, sizeof(Profile));
+
+    double start = profile_clock();
+    for (int i = 0; i < 10000; i++)
+        profile_clock();
+    profile->clock_overhead = (profile_clock() - start) / 10000;
+
+    profile->seed = 0x2545f491;
+    next_sample(profile);
+
+    state->profile = profile;
+    profiled = state;
+
+    if (!registered)
+        atexit(report_at_exit);
+    registered = true;
+}
+
+// Writes the report, to be called while state's memory is still around
+void profile_finish(Cpu_state *state) {
+    if (!state->profile)
+        return;
+
+    write_report(state);
+    free(state->profile);
+    state->profile = NULL;
+
+    if (profiled == state)
+        profiled = NULL;
+}
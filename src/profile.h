@@ -0,0 +1,44 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include "cpu.h"
+
+// Execution profile, filled in by the interpreter when PROFILE is set. Every
+// instruction is counted, and one in about PROFILE_SAMPLE_INTERVAL is timed
+// on the host.
+
+#define PROFILE_FILE "profile.txt"
+#define PROFILE_SAMPLE_INTERVAL 512
+
+typedef struct {
+    uint64_t count;
+    uint64_t cycles;
+    uint64_t samples;
+    double ns; // sampled host time
+} Profile_entry;
+
+typedef struct Profile {
+    Profile_entry ops[0x100];
+    Profile_entry pcs[0x10000];
+    uint8_t entry_point[0x10000]; // called, or jumped to by an interrupt
+    uint16_t last_pc;
+    uint8_t last_op;
+    int until_sample;
+    uint32_t seed;
+    double clock_overhead;
+} Profile;
+
+void profile_init(Cpu_state *state);
+void profile_finish(Cpu_state *state);
+void profile_report(Cpu_state *state, FILE *out);
+double profile_clock();
+void profile_record(Profile *profile, uint16_t pc, uint8_t op_code, int cyc,
+        double ns);
+
+// Whether the next instruction should be timed
+static inline bool profile_sample(Profile *profile) {
+    return --profile->until_sample <= 0;
+}
+
+#endif
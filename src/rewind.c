@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rewind.h"
+
+static uint8_t *ram_page(Arcade_system *system, int page) {
+    return &system->ram[page * PAGE_SIZE];
+}
+
+// Whether a RAM page differs from the newest frame. Pages that were written
+// the same bytes again are left out.
+static bool page_changed(Rewind *rewind, Arcade_system *system, int page) {
+#if !FLAT_MEMORY
+    if (!(system->state->map.dirty[(RAM_START >> PAGE_SHIFT) + page]
+                & (1 << DIRTY_REWIND)))
+        return false;
+#endif
+
+    return memcmp(ram_page(system, page), &rewind->ram[page * PAGE_SIZE],
+            PAGE_SIZE) != 0;
+}
+
+static void track_ram(Arcade_system *system) {
+#if FLAT_MEMORY
+    (void)system;
+#else
+    track_dirty_pages(system->state, RAM_START, RAM_SIZE, DIRTY_REWIND);
+#endif
+}
+
+// Starts a buffer holding the system as it is now
+Rewind *rewind_init(Arcade_system *system) {
+    Rewind *rewind = calloc(1, sizeof(Rewind));
+    rewind->pool = malloc(REWIND_POOL_PAGES * PAGE_SIZE);
+
+    if (!rewind->pool) {
+        printf("Could not allocate the rewind buffer\n");
+        exit(1);
+    }
+
+    memcpy(rewind->ram, ram_page(system, 0), RAM_SIZE);
+    machine_state_take(system, &rewind->frames[0].machine);
+    rewind->next = 1;
+    track_ram(system);
+
+    return rewind;
+}
+
+void rewind_free(Rewind *rewind) {
+    free(rewind->pool);
+    free(rewind);
+}
+
+// Records the system as it is now, to be called once a frame
+void rewind_push(Rewind *rewind, Arcade_system *system) {
+    uint8_t pages[RAM_PAGES];
+    int count = 0;
+
+    for (int page = 0; page < RAM_PAGES; page++) {
+        if (page_changed(rewind, system, page))
+            pages[count++] = page;
+    }
+
+    // Make room, the oldest frame's pages are the first to be overwritten
+    while (rewind->oldest < rewind->next
+            && (rewind->next - rewind->oldest >= REWIND_FRAMES
+                || rewind->pool_next + count
+                    - rewind->frames[rewind->oldest % REWIND_FRAMES].first
+                    > REWIND_POOL_PAGES))
+        rewind->oldest++;
+
+    Rewind_frame *frame = &rewind->frames[rewind->next++ % REWIND_FRAMES];
+    frame->first = rewind->pool_next;
+    frame->count = count;
+
+    for (int i = 0; i < count; i++) {
+        uint8_t *newest = &rewind->ram[pages[i] * PAGE_SIZE];
+
+        frame->pages[i] = pages[i];
+        memcpy(rewind->pool[rewind->pool_next++ % REWIND_POOL_PAGES], newest,
+                PAGE_SIZE);
+        memcpy(newest, ram_page(system, pages[i]), PAGE_SIZE);
+    }
+
+    machine_state_take(system, &frame->machine);
+    track_ram(system);
+}
+
+// Puts the system back to the newest frame, then drops up to that many
+// frames and goes back to the one before them. Returns the frames dropped.
+// The input is left alone, since it's whatever is being held down now.
+int rewind_back(Rewind *rewind, Arcade_system *system, int frames) {
+    bool changed[RAM_PAGES] = {false};
+    int dropped = 0;
+
+    for (int page = 0; page < RAM_PAGES; page++) {
+        if (page_changed(rewind, system, page)) {
+            memcpy(ram_page(system, page), &rewind->ram[page * PAGE_SIZE],
+                    PAGE_SIZE);
+            changed[page] = true;
+        }
+    }
+
+    while (dropped < frames && rewind->next - rewind->oldest > 1) {
+        Rewind_frame *frame = &rewind->frames[--rewind->next % REWIND_FRAMES];
+
+        for (int i = 0; i < frame->count; i++) {
+            int page = frame->pages[i];
+            uint8_t *undo = rewind->pool[(frame->first + i) % REWIND_POOL_PAGES];
+
+            memcpy(&rewind->ram[page * PAGE_SIZE], undo, PAGE_SIZE);
+            memcpy(ram_page(system, page), undo, PAGE_SIZE);
+            changed[page] = true;
+        }
+
+        rewind->pool_next = frame->first;
+        dropped++;
+    }
+
+    Rewind_frame *newest = &rewind->frames[(rewind->next - 1) % REWIND_FRAMES];
+    Input input = *system->input;
+    machine_state_restore(system, &newest->machine);
+    *system->input = input;
+
+    for (int page = 0; page < RAM_PAGES; page++) {
+        if (changed[page])
+            flush_ram(system, page * PAGE_SIZE, PAGE_SIZE);
+    }
+    track_ram(system);
+
+    return dropped;
+}
+
+// How far back the buffer goes
+int rewind_frames(Rewind *rewind) {
+    return rewind->next - rewind->oldest - 1;
+}
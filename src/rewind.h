@@ -0,0 +1,41 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "snapshot.h"
+
+// Rewind buffer, pushed every frame. Each frame keeps the machine state and
+// only the RAM pages that changed since the frame before, as they were
+// before the change, so going back is a matter of undoing frames newest
+// first. Pages are found through the memory map's dirty tracking.
+//
+// Memory is bounded by REWIND_POOL_PAGES, the oldest frames are dropped
+// when it fills, or when there are more than REWIND_FRAMES.
+
+#define REWIND_SECONDS 10
+#define REWIND_FRAMES (REWIND_SECONDS * FRAMERATE)
+#define REWIND_POOL_PAGES 4096 // 1 MB
+#define RAM_PAGES (RAM_SIZE / PAGE_SIZE)
+
+typedef struct {
+    Machine_state machine;
+    uint64_t first; // pool index of the first undo page
+    uint8_t count;
+    uint8_t pages[RAM_PAGES]; // RAM page of each undo page
+} Rewind_frame;
+
+typedef struct Rewind {
+    Rewind_frame frames[REWIND_FRAMES];
+    uint64_t oldest; // frame counters, newest is next - 1
+    uint64_t next;
+    uint8_t (*pool)[PAGE_SIZE];
+    uint64_t pool_next;
+    uint8_t ram[RAM_SIZE]; // RAM as of the newest frame
+} Rewind;
+
+Rewind *rewind_init(Arcade_system *system);
+void rewind_free(Rewind *rewind);
+void rewind_push(Rewind *rewind, Arcade_system *system);
+int rewind_back(Rewind *rewind, Arcade_system *system, int frames);
+int rewind_frames(Rewind *rewind);
+
+#endif
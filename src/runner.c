@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "machine.h"
+#include "pool.h"
+#include "script.h"
+
+// Runs many independent systems at once across all cores, for input fuzzing
+// and ROM regression runs. Every system maps the same copy of the ROM.
+// Nothing here may depend on SDL.
+
+typedef struct {
+    long frames;
+    char script[256]; // path, "random:seed" or "-" for no input
+    long long cycles;
+    uint64_t hash; // of the video RAM at the end
+    double elapsed;
+    int failed;
+} Job;
+
+typedef struct {
+    Job *jobs;
+    const Rom *rom;
+} Run;
+
+#if !CPUDIAG
+static void usage(char *name) {
+    printf("Usage: %s [-j threads] [-r rom directory] jobs\n"
+            "       %s [-j threads] [-r rom directory] -n count [-f frames]\n"
+            "  -j  worker threads (default one per core)\n"
+            "  -n  run this many systems with random input, seeded 1 to count\n"
+            "  -f  frames each of those runs (default 3600)\n"
+            "Each line of the jobs file is a frame count and an input script,\n"
+            "\"-\" for no input or \"random:seed\" for random input.\n",
+            name, name);
+    exit(1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Job *read_jobs(const char *path, int *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Could not open %s\n", path);
+        exit(1);
+    }
+
+    int capacity = 0;
+    Job *jobs = NULL;
+    char line[320];
+    *count = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        char *text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\n' || *text == '\0')
+            continue;
+
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            jobs = realloc(jobs, capacity * sizeof(Job));
+        }
+
+        Job *job = &jobs[*count];
+        memset(job, 0, sizeof(Job));
+
+        if (sscanf(text, "%ld %255s", &job->frames, job->script) != 2) {
+            printf("%s: expected \"frames script\" on job %d\n", path,
+                    *count + 1);
+            exit(1);
+        }
+        (*count)++;
+    }
+
+    fclose(f);
+    return jobs;
+}
+
+static void run_job(void *context, int task, int worker) {
+    (void)worker;
+    Run *run = context;
+    Job *job = &run->jobs[task];
+    Input_script script = {0};
+
+    if (strncmp(job->script, "random:", 7) == 0) {
+        script_random(&script, strtoul(job->script + 7, NULL, 0), job->frames);
+    } else if (strcmp(job->script, "-") != 0
+            && script_load(&script, job->script) != 0) {
+        job->failed = 1;
+        return;
+    }
+
+    Arcade_system system;
+    initialise_system_with_rom(&system, run->rom);
+
+    double start = now();
+    for (long frame = 0; frame < job->frames; frame++) {
+        script_apply(&script, frame, system.input);
+        job->cycles += run_frame(&system);
+    }
+    job->elapsed = now() - start;
+    job->hash = hash_vram(&system);
+
+    free_system(&system);
+    script_free(&script);
+}
+#endif
+
+int main(int argc, char **argv) {
+#if CPUDIAG
+    (void)argc;
+    (void)argv;
+    printf("The runner needs a Space Invaders build, CPUDIAG is set\n");
+    return 1;
+#else
+    int threads = pool_threads();
+    char *rom_path = "rom";
+    int random_jobs = 0;
+    long random_frames = 3600;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:r:n:f:")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            rom_path = optarg;
+            break;
+        case 'n':
+            random_jobs = atoi(optarg);
+            break;
+        case 'f':
+            random_frames = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    int count = random_jobs;
+    Job *jobs;
+
+    if (random_jobs) {
+        if (optind != argc)
+            usage(argv[0]);
+
+        jobs = calloc(count, sizeof(Job));
+        for (int i = 0; i < count; i++) {
+            jobs[i].frames = random_frames;
+            snprintf(jobs[i].script, sizeof(jobs[i].script), "random:%d", i + 1);
+        }
+    } else {
+        if (argc - optind != 1)
+            usage(argv[0]);
+        jobs = read_jobs(argv[optind], &count);
+    }
+
+    Rom *rom = load_rom(rom_path);
+    Run run = {jobs, rom};
+
+    double start = now();
+    pool_run(count, threads, run_job, &run);
+    double elapsed = now() - start;
+
+    long long frames = 0, cycles = 0;
+    int failed = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].failed) {
+            printf("job %d: %s failed\n", i + 1, jobs[i].script);
+            failed++;
+            continue;
+        }
+
+        printf("job %d: %s %ld frames, %lld cycles in %.3f s, %016llx\n", i + 1,
+                jobs[i].script, jobs[i].frames, jobs[i].cycles, jobs[i].elapsed,
+                (unsigned long long)jobs[i].hash);
+        frames += jobs[i].frames;
+        cycles += jobs[i].cycles;
+    }
+
+    printf("%d jobs on %d threads, %lld frames, %lld cycles in %.3f s "
+            "(%.2f MHz, %.1fx realtime)\n",
+            count, threads < count ? threads : count, frames, cycles, elapsed,
+            cycles / elapsed / 1e6, frames / elapsed / FRAMERATE);
+
+    free_rom(rom);
+    free(jobs);
+    return failed ? 1 : 0;
+#endif
+}
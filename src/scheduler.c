@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "scheduler.h"
+
+static bool sooner(const Event *a, const Event *b) {
+    return a->cycle < b->cycle || (a->cycle == b->cycle && a->order < b->order);
+}
+
+void scheduler_clear(Scheduler *scheduler) {
+    scheduler->count = 0;
+    scheduler->scheduled = 0;
+}
+
+void schedule_event(Scheduler *scheduler, uint64_t cycle,
+        Event_handler handler, void *context, int arg) {
+    if (scheduler->count == MAX_EVENTS) {
+        printf("Too many events pending\n");
+        exit(1);
+    }
+
+    Event event = {cycle, scheduler->scheduled++, handler, context, arg};
+    Event *heap = scheduler->heap;
+    int i = scheduler->count++;
+
+    // Sift up from the end
+    while (i > 0 && sooner(&event, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = event;
+}
+
+// Takes the soonest event off, the scheduler must not be empty
+Event pop_event(Scheduler *scheduler) {
+    Event *heap = scheduler->heap;
+    Event top = heap[0];
+    Event last = heap[--scheduler->count];
+    int i = 0;
+
+    // Sift the last event down from the top
+    while (true) {
+        int child = 2 * i + 1;
+
+        if (child >= scheduler->count)
+            break;
+        if (child + 1 < scheduler->count && sooner(&heap[child + 1], &heap[child]))
+            child++;
+        if (!sooner(&heap[child], &last))
+            break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+
+    return top;
+}
@@ -0,0 +1,41 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+// Callbacks at future cycles, for the devices around the CPU. The pending
+// events are kept in a fixed min-heap on the soonest cycle, so the CPU only
+// has to be run up to the one at the top, and adding a device costs nothing
+// between its events. Events due at the same cycle run in the order they
+// were scheduled.
+
+#define MAX_EVENTS 16
+
+// Given the cycle it was due at, the CPU may have got a few cycles past it
+typedef void (*Event_handler)(void *context, uint64_t cycle, int arg);
+
+typedef struct {
+    uint64_t cycle;
+    uint64_t order; // breaks ties between events due at the same cycle
+    Event_handler handler;
+    void *context;
+    int arg;
+} Event;
+
+typedef struct {
+    Event heap[MAX_EVENTS];
+    int count;
+    uint64_t scheduled; // events ever scheduled, for their order
+} Scheduler;
+
+void scheduler_clear(Scheduler *scheduler);
+void schedule_event(Scheduler *scheduler, uint64_t cycle,
+        Event_handler handler, void *context, int arg);
+Event pop_event(Scheduler *scheduler);
+
+// The cycle the soonest event is due at, the scheduler must not be empty
+static inline uint64_t next_event_cycle(const Scheduler *scheduler) {
+    return scheduler->heap[0].cycle;
+}
+
+#endif
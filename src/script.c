@@ -0,0 +1,108 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "script.h"
+
+#define NAME(name) #name,
+#define OFFSET(name) offsetof(Input, name),
+
+static const char *input_names[] = { INPUTS(NAME) };
+static const size_t input_offsets[] = { INPUTS(OFFSET) };
+
+#define INPUT_COUNT (int)(sizeof(input_names) / sizeof(input_names[0]))
+
+static void add_event(Input_script *script, int *capacity, Script_event event) {
+    if (script->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        script->events = realloc(script->events,
+                *capacity * sizeof(Script_event));
+    }
+
+    script->events[script->count++] = event;
+}
+
+int script_load(Input_script *script, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Could not open %s\n", path);
+        return -1;
+    }
+
+    int capacity = 0;
+    int line_number = 0;
+    char line[128];
+
+    memset(script, 0, sizeof(Input_script));
+
+    while (fgets(line, sizeof(line), f)) {
+        line_number++;
+
+        char *text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\n' || *text == '\0')
+            continue;
+
+        long frame;
+        char sign, name[32];
+        int input = INPUT_COUNT;
+
+        if (sscanf(text, "%ld %c%31s", &frame, &sign, name) == 3
+                && (sign == '+' || sign == '-')) {
+            for (input = 0; input < INPUT_COUNT; input++) {
+                if (strcmp(name, input_names[input]) == 0)
+                    break;
+            }
+        }
+
+        if (input == INPUT_COUNT || (script->count
+                    && frame < script->events[script->count - 1].frame)) {
+            printf("%s:%d: expected \"frame +input\" or \"frame -input\" "
+                    "in frame order\n", path, line_number);
+            fclose(f);
+            script_free(script);
+            return -1;
+        }
+
+        add_event(script, &capacity,
+                (Script_event){frame, input, sign == '+'});
+    }
+
+    fclose(f);
+    return 0;
+}
+
+// Presses and releases inputs at random for fuzzing, a few times a second
+void script_random(Input_script *script, uint32_t seed, long frames) {
+    int capacity = 0;
+    uint32_t x = seed ? seed : 1;
+    uint8_t down[INPUT_COUNT] = {0};
+
+    memset(script, 0, sizeof(Input_script));
+
+    for (long frame = 0; frame < frames; ) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+
+        frame += 1 + x % 30;
+        int input = (x >> 8) % INPUT_COUNT;
+        down[input] = !down[input];
+        add_event(script, &capacity, (Script_event){frame, input, down[input]});
+    }
+}
+
+// Applies the events up to and including frame
+void script_apply(Input_script *script, long frame, Input *input) {
+    while (script->next < script->count
+            && script->events[script->next].frame <= frame) {
+        Script_event *event = &script->events[script->next++];
+        *(int *)((char *)input + input_offsets[event->input]) = event->down;
+    }
+}
+
+void script_free(Input_script *script) {
+    free(script->events);
+    script->events = NULL;
+    script->count = 0;
+    script->next = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdint.h>
+#include "input.h"
+
+// Input scripts, for driving a system without a keyboard. A script file has
+// one event a line, pressing or releasing an input at the start of a frame:
+//
+//     # insert a coin and start a one player game
+//     60 +coin
+//     64 -coin
+//     120 +start1
+//     124 -start1
+//
+// Inputs are named as the fields of Input. Events must be in frame order.
+
+typedef struct {
+    long frame;
+    uint8_t input; // index in INPUTS order
+    uint8_t down;
+} Script_event;
+
+typedef struct {
+    Script_event *events;
+    int count;
+    int next; // first event not yet applied
+} Input_script;
+
+int script_load(Input_script *script, const char *path);
+void script_random(Input_script *script, uint32_t seed, long frames);
+void script_apply(Input_script *script, long frame, Input *input);
+void script_free(Input_script *script);
+
+#endif
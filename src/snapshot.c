@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include "snapshot.h"
+
+// Registers, sp, pc, flags, int_enable, cyc, shift, offset, inputs, RAM
+#define PAYLOAD_SIZE (7 + 2 + 2 + 1 + 1 + 4 + 2 + 1 + 2 + RAM_SIZE)
+
+void machine_state_take(Arcade_system *system, Machine_state *machine) {
+    Cpu_state *state = system->state;
+
+    memcpy(machine->regs, state->regs, sizeof(machine->regs));
+    machine->sp = state->sp;
+    machine->pc = state->pc;
+    machine->flags = read_flags(state);
+    machine->int_enable = state->int_enable;
+    machine->cyc = system->cycles - system->frame_start;
+    machine->port = *system->port;
+    machine->input = *system->input;
+}
+
+void machine_state_restore(Arcade_system *system, const Machine_state *machine) {
+    Cpu_state *state = system->state;
+
+    memcpy(state->regs, machine->regs, sizeof(state->regs));
+    state->sp = machine->sp;
+    state->pc = machine->pc;
+    write_flags(state, machine->flags);
+    state->int_enable = machine->int_enable;
+    *system->port = machine->port;
+    *system->input = machine->input;
+    reset_events(system, machine->cyc);
+}
+
+// For RAM changed without going through write_memory. Anything decoded or
+// translated from it, or from its mirror, is stale.
+void flush_ram(Arcade_system *system, uint16_t offset, uint32_t size) {
+#if FLAT_MEMORY
+    (void)system;
+    (void)offset;
+    (void)size;
+#else
+    flush_code(system->state, RAM_START + offset, size);
+    flush_code(system->state, RAM_START + RAM_SIZE + offset, size);
+#endif
+}
+
+void snapshot_take(Arcade_system *system, Snapshot *snapshot) {
+    machine_state_take(system, &snapshot->machine);
+    memcpy(snapshot->ram, system->ram, RAM_SIZE);
+}
+
+void snapshot_restore(Arcade_system *system, const Snapshot *snapshot) {
+    machine_state_restore(system, &snapshot->machine);
+    memcpy(system->ram, snapshot->ram, RAM_SIZE);
+    flush_ram(system, 0, RAM_SIZE);
+}
+
+// -- File format --
+
+static uint8_t *put16(uint8_t *p, uint16_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t value) {
+    p = put16(p, value);
+    return put16(p, value >> 16);
+}
+
+static const uint8_t *get16(const uint8_t *p, uint16_t *value) {
+    *value = p[0] | (p[1] << 8);
+    return p + 2;
+}
+
+static const uint8_t *get32(const uint8_t *p, uint32_t *value) {
+    uint16_t low, high;
+    p = get16(p, &low);
+    p = get16(p, &high);
+    *value = low | ((uint32_t)high << 16);
+    return p;
+}
+
+int snapshot_save(const Snapshot *snapshot, const char *path) {
+    uint8_t buffer[16 + PAYLOAD_SIZE]; // not static, other threads may save too
+    uint8_t *p = buffer;
+
+    memset(p, 0, 8);
+    memcpy(p, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    p = put32(p + 8, SNAPSHOT_VERSION);
+    p = put32(p, PAYLOAD_SIZE);
+
+    memcpy(p, snapshot->machine.regs, 7);
+    p = put16(p + 7, snapshot->machine.sp);
+    p = put16(p, snapshot->machine.pc);
+    *p++ = snapshot->machine.flags;
+    *p++ = snapshot->machine.int_enable;
+    p = put32(p, snapshot->machine.cyc);
+    p = put16(p, snapshot->machine.port.shift);
+    *p++ = snapshot->machine.port.offset;
+
+    p = put16(p, input_bits(&snapshot->machine.input));
+
+    memcpy(p, snapshot->ram, RAM_SIZE);
+    p += RAM_SIZE;
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        printf("Could not open %s\n", path);
+        return -1;
+    }
+
+    size_t written = fwrite(buffer, 1, p - buffer, f);
+    if (fclose(f) != 0 || written != (size_t)(p - buffer)) {
+        printf("Could not write %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int snapshot_load(Snapshot *snapshot, const char *path) {
+    uint8_t buffer[16 + PAYLOAD_SIZE];
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Could not open %s\n", path);
+        return -1;
+    }
+
+    size_t bytes_read = fread(buffer, 1, sizeof(buffer), f);
+    fclose(f);
+
+    uint32_t version, size;
+    const uint8_t *p = buffer;
+
+    if (bytes_read < 16 || memcmp(p, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        printf("%s is not a snapshot\n", path);
+        return -1;
+    }
+
+    p = get32(p + 8, &version);
+    p = get32(p, &size);
+
+    if (version != SNAPSHOT_VERSION || size != PAYLOAD_SIZE) {
+        printf("%s is snapshot version %u, expected %u\n", path, version,
+                SNAPSHOT_VERSION);
+        return -1;
+    }
+
+    if (bytes_read != 16 + PAYLOAD_SIZE) {
+        printf("%s is truncated\n", path);
+        return -1;
+    }
+
+    uint32_t cyc;
+    uint16_t inputs;
+
+    memcpy(snapshot->machine.regs, p, 7);
+    p = get16(p + 7, &snapshot->machine.sp);
+    p = get16(p, &snapshot->machine.pc);
+    snapshot->machine.flags = *p++;
+    snapshot->machine.int_enable = *p++;
+    p = get32(p, &cyc);
+    snapshot->machine.cyc = (int32_t)cyc;
+    p = get16(p, &snapshot->machine.port.shift);
+    snapshot->machine.port.offset = *p++;
+    p = get16(p, &inputs);
+
+    memset(&snapshot->machine.input, 0, sizeof(Input));
+    set_input_bits(&snapshot->machine.input, inputs);
+
+    memcpy(snapshot->ram, p, RAM_SIZE);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "machine.h"
+
+// Save states. Taking and restoring a snapshot only copies memory, so one
+// can be taken every frame to fork or rewind a run. snapshot_save and
+// snapshot_load store them in a versioned little-endian file format.
+
+#define SNAPSHOT_MAGIC "I8080SS"
+#define SNAPSHOT_VERSION 1
+
+// Everything but the RAM
+typedef struct {
+    uint8_t regs[7];
+    uint16_t sp;
+    uint16_t pc;
+    uint8_t flags;
+    uint8_t int_enable;
+    int32_t cyc; // run since the frame began, its overshoot between frames
+    Port port;
+    Input input;
+} Machine_state;
+
+typedef struct {
+    Machine_state machine;
+    uint8_t ram[RAM_SIZE];
+} Snapshot;
+
+void machine_state_take(Arcade_system *system, Machine_state *machine);
+void machine_state_restore(Arcade_system *system, const Machine_state *machine);
+void flush_ram(Arcade_system *system, uint16_t offset, uint32_t size);
+void snapshot_take(Arcade_system *system, Snapshot *snapshot);
+void snapshot_restore(Arcade_system *system, const Snapshot *snapshot);
+int snapshot_save(const Snapshot *snapshot, const char *path);
+int snapshot_load(Snapshot *snapshot, const char *path);
+
+#endif
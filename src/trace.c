@@ -0,0 +1,113 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+static Trace *traced; // dumped at exit or on a signal
+
+static int write_all(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written <= 0)
+            return -1;
+        bytes += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+// Writes the records oldest first. Only uses async-signal-safe calls, so it
+// can run from a signal handler.
+int trace_dump(Trace *trace, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    uint64_t next = trace->next;
+    uint64_t count = next < TRACE_RECORDS ? next : TRACE_RECORDS;
+    uint64_t oldest = (next - count) & (TRACE_RECORDS - 1);
+
+    Trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(Trace_record);
+    header.count = count;
+    header.total = next;
+
+    // The ring wraps at most once
+    uint64_t first = count < TRACE_RECORDS - oldest ? count : TRACE_RECORDS - oldest;
+    int result = write_all(fd, &header, sizeof(header))
+        || write_all(fd, &trace->records[oldest], first * sizeof(Trace_record))
+        || write_all(fd, trace->records, (count - first) * sizeof(Trace_record));
+
+    close(fd);
+    return result ? -1 : 0;
+}
+
+static void dump_at_exit() {
+    if (!traced)
+        return;
+
+    if (trace_dump(traced, TRACE_FILE) == 0)
+        printf("Trace written to %s\n", TRACE_FILE);
+    else
+        printf("Could not write %s\n", TRACE_FILE);
+}
+
+static void dump_on_signal(int signal) {
+    if (traced)
+        trace_dump(traced, TRACE_FILE);
+
+    if (signal == SIGUSR1)
+        return; // a look at a hung run, carry on
+
+    // Crashed, die the way we would have without the handler
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(signal, &action, NULL);
+    raise(signal);
+}
+
+// Starts tracing state, see trace.h for when the trace is written out
+void trace_init(Cpu_state *state) {
+    static bool installed;
+
+    state->trace = calloc(1, sizeof(Trace));
+    traced = state->trace;
+
+    if (installed)
+        return;
+    installed = true;
+
+    atexit(dump_at_exit);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dump_on_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+
+    int signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGUSR1};
+    for (unsigned i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+        sigaction(signals[i], &action, NULL);
+}
+
+// Stops tracing state without writing anything, for runs that ended normally
+void trace_finish(Cpu_state *state) {
+    if (!state->trace)
+        return;
+
+    if (traced == state->trace)
+        traced = NULL;
+
+    free(state->trace);
+    state->trace = NULL;
+}
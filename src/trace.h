@@ -0,0 +1,62 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "cpu.h"
+
+// Execution trace, filled in by the interpreter when TRACE is set. The last
+// TRACE_RECORDS instructions are kept in a ring buffer and written to
+// TRACE_FILE when the program exits or crashes, or on SIGUSR1 for a run that
+// has hung. tracedump renders the file.
+
+#define TRACE_RECORDS (1 << 16) // a power of two
+#define TRACE_FILE "trace.bin"
+
+#define TRACE_MAGIC "I8080TR"
+#define TRACE_VERSION 1
+
+// State before the instruction ran
+typedef struct {
+    uint64_t cycle; // cycles run before this instruction
+    uint16_t pc;
+    uint16_t sp;
+    uint16_t operand;
+    uint8_t op_code;
+    uint8_t flags;
+    uint8_t regs[7];
+} Trace_record;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count; // records following, oldest first
+    uint64_t total; // instructions traced, including overwritten ones
+} Trace_header;
+
+typedef struct Trace {
+    Trace_record records[TRACE_RECORDS];
+    uint64_t next; // count of records written
+    uint64_t cycles;
+} Trace;
+
+void trace_init(Cpu_state *state);
+void trace_finish(Cpu_state *state);
+int trace_dump(Trace *trace, const char *path);
+
+static inline void trace_record(Cpu_state *state, uint8_t op_code) {
+    Trace *trace = state->trace;
+    Trace_record *record = &trace->records[trace->next & (TRACE_RECORDS - 1)];
+
+    record->cycle = trace->cycles;
+    record->pc = state->pc;
+    record->sp = state->sp;
+    record->operand = fetch_operand(state, state->pc, op_length[op_code]);
+    record->op_code = op_code;
+    record->flags = read_flags(state);
+    for (int i = 0; i < 7; i++)
+        record->regs[i] = state->regs[i];
+
+    trace->next++;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#include <string.h>
+#include "triple_buffer.h"
+
+void triple_buffer_init(Triple_buffer *buffer) {
+    memset(buffer->frames, 0, sizeof(buffer->frames));
+    buffer->back = 0;
+    atomic_init(&buffer->middle, 1);
+    buffer->front = 2;
+}
+
+// The frame for the emulation thread to fill in
+Frame *triple_buffer_back(Triple_buffer *buffer) {
+    return &buffer->frames[buffer->back];
+}
+
+// Makes the back frame the newest, release ordered so that its contents are
+// visible to the render thread before it can take it
+void triple_buffer_publish(Triple_buffer *buffer) {
+    int old = atomic_exchange_explicit(&buffer->middle,
+            buffer->back | TRIPLE_BUFFER_FRESH, memory_order_acq_rel);
+    buffer->back = old & ~TRIPLE_BUFFER_FRESH;
+}
+
+// The newest frame if one was published since the last call, or NULL. The
+// frame stays valid until the next call.
+Frame *triple_buffer_take(Triple_buffer *buffer) {
+    if (!(atomic_load_explicit(&buffer->middle, memory_order_relaxed)
+                & TRIPLE_BUFFER_FRESH))
+        return NULL;
+
+    int old = atomic_exchange_explicit(&buffer->middle, buffer->front,
+            memory_order_acq_rel);
+    buffer->front = old & ~TRIPLE_BUFFER_FRESH;
+    return &buffer->frames[buffer->front];
+}
@@ -0,0 +1,33 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <stdatomic.h>
+#include "machine.h"
+
+// Hands finished frames from the emulation thread to the render thread
+// without either waiting on the other. The emulation thread fills the back
+// frame and swaps it with the middle one, the render thread swaps the
+// middle one for its front frame whenever a new one has been published.
+// Frames the renderer was too slow to see are dropped.
+
+typedef struct {
+    uint8_t vram[VRAM_SIZE];
+    uint64_t number;
+    uint32_t dirty; // a bit per VRAM page written since the frame before
+} Frame;
+
+typedef struct {
+    Frame frames[3];
+    int back; // owned by the emulation thread
+    int front; // owned by the render thread
+    atomic_int middle; // index, with TRIPLE_BUFFER_FRESH if not yet taken
+} Triple_buffer;
+
+#define TRIPLE_BUFFER_FRESH 0x4
+
+void triple_buffer_init(Triple_buffer *buffer);
+Frame *triple_buffer_back(Triple_buffer *buffer);
+void triple_buffer_publish(Triple_buffer *buffer);
+Frame *triple_buffer_take(Triple_buffer *buffer);
+
+#endif
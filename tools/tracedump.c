@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "trace.h"
+#include "disassembler.h"
+
+// Renders a trace written by a TRACE build, oldest instruction first. Each
+// line shows the machine state just before the instruction ran.
+
+static void print_record(Trace_record *record) {
+    uint8_t code[3] = {
+        record->op_code, record->operand & 0xff, record->operand >> 8
+    };
+    uint8_t f = record->flags;
+
+    printf("%12llu  %04x  %02x  ", (unsigned long long)record->cycle,
+            record->pc, record->op_code);
+
+    // Pad the instruction out to a column
+    char text[32];
+    FILE *out = fmemopen(text, sizeof(text), "w");
+    fdisassemble_op(out, code, 0);
+    fclose(out);
+    printf("%-18s", text);
+
+    printf("A=%02x BC=%02x%02x DE=%02x%02x HL=%02x%02x SP=%04x %c%c%c%c%c\n",
+            record->regs[A], record->regs[B], record->regs[C],
+            record->regs[D], record->regs[E], record->regs[H], record->regs[L],
+            record->sp,
+            f & FLAG_S ? 'S' : '-', f & FLAG_Z ? 'Z' : '-',
+            f & FLAG_AC ? 'A' : '-', f & FLAG_P ? 'P' : '-',
+            f & FLAG_CY ? 'C' : '-');
+}
+
+int main(int argc, char **argv) {
+    char *path = argc > 1 ? argv[1] : TRACE_FILE;
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Could not open %s\n", path);
+        exit(1);
+    }
+
+    Trace_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1
+            || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        printf("%s is not a trace\n", path);
+        exit(1);
+    }
+
+    if (header.version != TRACE_VERSION
+            || header.record_size != sizeof(Trace_record)) {
+        printf("%s is trace version %u, expected %u\n", path, header.version,
+                TRACE_VERSION);
+        exit(1);
+    }
+
+    printf("Last %llu of %llu instructions\n\n",
+            (unsigned long long)header.count, (unsigned long long)header.total);
+    printf("       cycle  pc    op  instruction       state\n");
+
+    Trace_record record;
+    for (uint64_t i = 0; i < header.count; i++) {
+        if (fread(&record, sizeof(record), 1, f) != 1) {
+            printf("Trace is truncated\n");
+            exit(1);
+        }
+        print_record(&record);
+    }
+
+    fclose(f);
+    return 0;
+}